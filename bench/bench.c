@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <aml.h>
+
+#include "bench.h"
+
+void bench_init(struct bench* self, const char* name, int argc, char* argv[])
+{
+	memset(self, 0, sizeof(*self));
+	self->name = name;
+	self->argc = argc;
+	self->argv = argv;
+	self->backend = "default";
+
+	for (int i = 1; i < argc; ++i)
+		if (strncmp(argv[i], "--backend=", 10) == 0)
+			self->backend = argv[i] + 10;
+}
+
+struct aml* bench_new_aml(struct bench* self)
+{
+	static const struct {
+		const char* name;
+		enum aml_backend_type type;
+	} backends[] = {
+		{ "default", AML_BACKEND_DEFAULT },
+		{ "epoll", AML_BACKEND_EPOLL },
+		{ "kqueue", AML_BACKEND_KQUEUE },
+		{ "posix", AML_BACKEND_POSIX },
+	};
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+		if (strcmp(self->backend, backends[i].name) != 0)
+			continue;
+
+		enum aml_flags flags = AML_FLAGS_NONE;
+		if (bench_param(self, "single-threaded", 0))
+			flags |= AML_SINGLE_THREADED;
+
+		struct aml* aml = aml_new_with_flags(backends[i].type, flags);
+		if (!aml) {
+			fprintf(stderr, "Backend not available: %s\n",
+					self->backend);
+			exit(1);
+		}
+
+		return aml;
+	}
+
+	fprintf(stderr, "Unknown backend: %s\n", self->backend);
+	exit(1);
+}
+
+long bench_param(struct bench* self, const char* name, long default_value)
+{
+	long value = default_value;
+	size_t len = strlen(name);
+
+	for (int i = 1; i < self->argc; ++i) {
+		const char* arg = self->argv[i];
+		if (strncmp(arg, "--", 2) == 0 &&
+				strncmp(arg + 2, name, len) == 0 &&
+				arg[2 + len] == '=')
+			value = strtol(arg + 3 + len, NULL, 0);
+	}
+
+	assert(self->n_params < BENCH_MAX_ENTRIES);
+	snprintf(self->params[self->n_params].name,
+			sizeof(self->params[0].name), "%s", name);
+	self->params[self->n_params].value = value;
+	self->n_params++;
+
+	return value;
+}
+
+void bench_metric(struct bench* self, const char* name, double value)
+{
+	assert(self->n_metrics < BENCH_MAX_ENTRIES);
+	snprintf(self->metrics[self->n_metrics].name,
+			sizeof(self->metrics[0].name), "%s", name);
+	self->metrics[self->n_metrics].value = value;
+	self->n_metrics++;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+void bench_samples(struct bench* self, const char* prefix, uint64_t* samples,
+		size_t n)
+{
+	if (n == 0)
+		return;
+
+	qsort(samples, n, sizeof(*samples), compare_u64);
+
+	double sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum += samples[i];
+
+	static const struct {
+		const char* suffix;
+		double quantile;
+	} stats[] = {
+		{ "min", 0.0 },
+		{ "median", 0.5 },
+		{ "p99", 0.99 },
+		{ "max", 1.0 },
+	};
+
+	for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s_%s", prefix, stats[i].suffix);
+
+		size_t index = stats[i].quantile * (n - 1);
+		bench_metric(self, name, samples[index]);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s_mean", prefix);
+	bench_metric(self, name, sum / n);
+}
+
+static void print_entries(const char* key, const struct bench_entry* entries,
+		int n)
+{
+	printf("\"%s\":{", key);
+	for (int i = 0; i < n; ++i)
+		printf("%s\"%s\":%.17g", i ? "," : "", entries[i].name,
+				entries[i].value);
+	printf("}");
+}
+
+void bench_finish(struct bench* self)
+{
+	printf("{\"benchmark\":\"%s\",\"backend\":\"%s\",", self->name,
+			self->backend);
+	print_entries("params", self->params, self->n_params);
+	printf(",");
+	print_entries("metrics", self->metrics, self->n_metrics);
+	printf("}\n");
+	fflush(stdout);
+}
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
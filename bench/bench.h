@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BENCH_MAX_ENTRIES 32
+
+struct bench_entry {
+	char name[64];
+	double value;
+};
+
+struct aml;
+
+struct bench {
+	const char* name;
+	const char* backend;
+	int argc;
+	char** argv;
+
+	struct bench_entry params[BENCH_MAX_ENTRIES];
+	int n_params;
+
+	struct bench_entry metrics[BENCH_MAX_ENTRIES];
+	int n_metrics;
+};
+
+void bench_init(struct bench*, const char* name, int argc, char* argv[]);
+
+/* Get an integer parameter given as --name=value on the command line. The
+ * value is recorded in the report.
+ */
+long bench_param(struct bench*, const char* name, long default_value);
+
+/* Create a main loop using the backend given as --backend=NAME on the command
+ * line. The loop is single threaded if --single-threaded=1 is given. Exits if
+ * the backend is not available.
+ */
+struct aml* bench_new_aml(struct bench*);
+
+void bench_metric(struct bench*, const char* name, double value);
+
+/* Record min, mean, median, p99 and max of a set of samples. The samples
+ * array is sorted in place.
+ */
+void bench_samples(struct bench*, const char* prefix, uint64_t* samples,
+		size_t n);
+
+/* Print the report as a single line of JSON on stdout. */
+void bench_finish(struct bench*);
+
+uint64_t bench_now_ns(void);
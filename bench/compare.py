@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2026 agent
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+# REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+# AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+# INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+# LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+# OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+
+"""Run the aml benchmarks and compare the results against a baseline.
+
+Typical use:
+
+    meson setup build -Dbenchmarks=true && ninja -C build
+    bench/compare.py run -C build -n 10
+    bench/compare.py baseline HEAD
+    ... make changes, rebuild ...
+    bench/compare.py run -C build -n 10
+    bench/compare.py compare
+
+Results are stored as JSON, one file per git commit, in the results directory
+(bench-results/ by default). 'compare' exits with status 1 if any metric has a
+statistically significant regression, so it can be used to gate CI.
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import subprocess
+import sys
+
+DEFAULT_RESULTS_DIR = "bench-results"
+BASELINE_NAME = "baseline.json"
+
+
+def git_commit(ref="HEAD"):
+    try:
+        out = subprocess.run(["git", "rev-parse", "--short", ref],
+                             check=True, capture_output=True, text=True)
+        return out.stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def list_benchmarks(build_dir):
+    out = subprocess.run(["meson", "introspect", "--benchmarks", build_dir],
+                         check=True, capture_output=True, text=True)
+    return json.loads(out.stdout)
+
+
+def run_benchmark(bench):
+    env = dict(os.environ)
+    env.update(bench.get("env") or {})
+    out = subprocess.run(bench["cmd"], check=True, capture_output=True,
+                         text=True, cwd=bench.get("workdir") or None, env=env)
+    for line in out.stdout.splitlines():
+        line = line.strip()
+        if line.startswith("{"):
+            return json.loads(line)["metrics"]
+    raise RuntimeError("No report from " + bench["name"])
+
+
+def cmd_run(args):
+    benchmarks = list_benchmarks(args.build_dir)
+    if args.filter:
+        benchmarks = [b for b in benchmarks if args.filter in b["name"]]
+
+    results = {}
+    for i in range(args.iterations):
+        for bench in benchmarks:
+            print("[{}/{}] {}".format(i + 1, args.iterations, bench["name"]),
+                  file=sys.stderr)
+            metrics = run_benchmark(bench)
+            entry = results.setdefault(bench["name"], {})
+            for name, value in metrics.items():
+                entry.setdefault(name, []).append(value)
+
+    commit = args.commit or git_commit()
+    os.makedirs(args.results_dir, exist_ok=True)
+    path = os.path.join(args.results_dir, commit + ".json")
+    with open(path, "w") as f:
+        json.dump({"commit": commit, "results": results}, f, indent=1)
+
+    print(path)
+    return 0
+
+
+def cmd_baseline(args):
+    path = resolve_results(args.results_dir, args.commit)
+    target = os.path.join(args.results_dir, BASELINE_NAME)
+    with open(path) as f:
+        data = json.load(f)
+    with open(target, "w") as f:
+        json.dump(data, f, indent=1)
+    print("{} -> {}".format(path, target))
+    return 0
+
+
+def resolve_results(results_dir, name):
+    if os.path.isfile(name):
+        return name
+    path = os.path.join(results_dir, git_commit(name) + ".json")
+    if not os.path.isfile(path):
+        path = os.path.join(results_dir, name + ".json")
+    if not os.path.isfile(path):
+        sys.exit("No results found for " + name)
+    return path
+
+
+def median(values):
+    s = sorted(values)
+    n = len(s)
+    mid = n // 2
+    return s[mid] if n % 2 else (s[mid - 1] + s[mid]) / 2
+
+
+def median_ci(values, confidence=0.95, resamples=2000):
+    """Bootstrap confidence interval of the median"""
+    if len(values) < 2:
+        return values[0], values[0]
+    rng = random.Random(0)
+    medians = sorted(median(rng.choices(values, k=len(values)))
+                     for _ in range(resamples))
+    lo = medians[int((1 - confidence) / 2 * resamples)]
+    hi = medians[int((1 + confidence) / 2 * resamples) - 1]
+    return lo, hi
+
+
+def mann_whitney_p(a, b):
+    """Two-sided p-value of the Mann-Whitney U test (normal approximation)"""
+    n1, n2 = len(a), len(b)
+    if n1 < 2 or n2 < 2:
+        return 1.0
+
+    combined = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    ranks = [0.0] * len(combined)
+    ties = 0.0
+    i = 0
+    while i < len(combined):
+        j = i
+        while j + 1 < len(combined) and combined[j + 1][0] == combined[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+
+    r1 = sum(r for r, (_, group) in zip(ranks, combined) if group == 0)
+    u = r1 - n1 * (n1 + 1) / 2
+    mu = n1 * n2 / 2
+    n = n1 + n2
+    sigma = math.sqrt(n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1))))
+    if sigma == 0:
+        return 1.0
+    z = (abs(u - mu) - 0.5) / sigma
+    return math.erfc(max(z, 0) / math.sqrt(2))
+
+
+def higher_is_better(metric):
+    return metric.endswith("_per_sec")
+
+
+def cmd_compare(args):
+    baseline_path = args.baseline or os.path.join(args.results_dir,
+                                                  BASELINE_NAME)
+    with open(resolve_results(args.results_dir, baseline_path)) as f:
+        baseline = json.load(f)
+    with open(resolve_results(args.results_dir, args.candidate)) as f:
+        candidate = json.load(f)
+
+    print("baseline: {}, candidate: {}".format(baseline["commit"],
+                                               candidate["commit"]))
+    fmt = "{:<40} {:<24} {:>14} {:>14} {:>8} {:>7}  {}"
+    print(fmt.format("benchmark", "metric", "baseline", "candidate",
+                     "change", "p", ""))
+
+    n_regressions = 0
+    for bench, metrics in sorted(candidate["results"].items()):
+        base_metrics = baseline["results"].get(bench)
+        if not base_metrics:
+            continue
+
+        for metric, values in sorted(metrics.items()):
+            base_values = base_metrics.get(metric)
+            if not base_values:
+                continue
+
+            base_median = median(base_values)
+            cand_median = median(values)
+            base_lo, base_hi = median_ci(base_values)
+            cand_lo, cand_hi = median_ci(values)
+            p = mann_whitney_p(base_values, values)
+
+            change = ((cand_median - base_median) / base_median
+                      if base_median else 0.0)
+            worse = change < 0 if higher_is_better(metric) else change > 0
+            overlap = cand_lo <= base_hi and base_lo <= cand_hi
+
+            verdict = ""
+            if p < args.alpha and not overlap and \
+                    abs(change) >= args.threshold:
+                verdict = "REGRESSION" if worse else "improvement"
+                if worse:
+                    n_regressions += 1
+
+            print(fmt.format(bench[:40], metric[:24],
+                             "{:.4g}".format(base_median),
+                             "{:.4g}".format(cand_median),
+                             "{:+.1%}".format(change),
+                             "{:.3f}".format(p), verdict))
+
+    if n_regressions:
+        print("{} significant regression(s)".format(n_regressions))
+        return 1
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+            formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-r", "--results-dir", default=DEFAULT_RESULTS_DIR)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    run = sub.add_parser("run", help="run benchmarks and store results")
+    run.add_argument("-C", "--build-dir", default="build")
+    run.add_argument("-n", "--iterations", type=int, default=5)
+    run.add_argument("-f", "--filter", help="only run matching benchmarks")
+    run.add_argument("--commit", help="store results under this name")
+    run.set_defaults(func=cmd_run)
+
+    baseline = sub.add_parser("baseline", help="save results as baseline")
+    baseline.add_argument("commit", nargs="?", default="HEAD")
+    baseline.set_defaults(func=cmd_baseline)
+
+    compare = sub.add_parser("compare", help="compare against baseline")
+    compare.add_argument("candidate", nargs="?", default="HEAD")
+    compare.add_argument("-b", "--baseline",
+                         help="results to compare against (default: the "
+                              "saved baseline)")
+    compare.add_argument("-a", "--alpha", type=float, default=0.05,
+                         help="significance level (default: 0.05)")
+    compare.add_argument("-t", "--threshold", type=float, default=0.05,
+                         help="minimum relative change (default: 0.05)")
+    compare.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
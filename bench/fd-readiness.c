@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* A number of pipes are all made readable at once and the loop has to
+ * dispatch all of them before the next round begins.
+ */
+
+struct fd_readiness {
+	struct aml* aml;
+	long n_fds;
+	long n_rounds;
+
+	int* fds;
+
+	long pending;
+	long round;
+	long n_events;
+};
+
+static void fire_all(struct fd_readiness* self)
+{
+	char one = 1;
+	for (long i = 0; i < self->n_fds; ++i)
+		if (write(self->fds[i * 2 + 1], &one, 1) != 1)
+			abort();
+
+	self->pending = self->n_fds;
+}
+
+static void on_readable(void* handler)
+{
+	struct fd_readiness* self = aml_get_userdata(handler);
+
+	char c;
+	if (read(aml_get_fd(handler), &c, 1) != 1)
+		return;
+
+	self->n_events++;
+
+	if (--self->pending > 0)
+		return;
+
+	if (++self->round < self->n_rounds)
+		fire_all(self);
+	else
+		aml_exit(self->aml);
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "fd-readiness", argc, argv);
+
+	struct fd_readiness self = { 0 };
+	self.n_fds = bench_param(&bench, "fds", 1000);
+	self.n_rounds = bench_param(&bench, "rounds", 1000);
+
+	self.aml = bench_new_aml(&bench);
+	self.fds = calloc(self.n_fds * 2, sizeof(*self.fds));
+	if (!self.aml || !self.fds)
+		return 1;
+
+	struct aml_handler** handlers =
+		calloc(self.n_fds, sizeof(*handlers));
+	if (!handlers)
+		return 1;
+
+	for (long i = 0; i < self.n_fds; ++i) {
+		if (pipe(&self.fds[i * 2]) < 0)
+			return 1;
+
+		fcntl(self.fds[i * 2], F_SETFL, O_NONBLOCK);
+
+		handlers[i] = aml_handler_new(self.fds[i * 2], on_readable,
+				&self, NULL);
+		aml_start(self.aml, handlers[i]);
+	}
+
+	uint64_t start = bench_now_ns();
+	fire_all(&self);
+	aml_run(self.aml);
+	uint64_t elapsed = bench_now_ns() - start;
+
+	bench_metric(&bench, "events_per_sec", self.n_events * 1e9 / elapsed);
+	bench_metric(&bench, "ns_per_event", (double)elapsed / self.n_events);
+	bench_finish(&bench);
+
+	for (long i = 0; i < self.n_fds; ++i) {
+		aml_stop(self.aml, handlers[i]);
+		aml_unref(handlers[i]);
+		close(self.fds[i * 2]);
+		close(self.fds[i * 2 + 1]);
+	}
+
+	aml_unref(self.aml);
+	free(handlers);
+	free(self.fds);
+	return 0;
+}
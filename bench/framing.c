@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* Newline delimited records are split out of a buffer that is handed over in
+ * read() sized chunks, first by scanning it one byte at a time and then using
+ * aml_framer.
+ */
+
+struct framing {
+	char* data;
+	size_t size;
+	size_t chunk_size;
+
+	size_t n_records;
+	size_t n_bytes;
+};
+
+static void on_record(struct framing* self, const char* data, size_t len)
+{
+	self->n_records++;
+	self->n_bytes += len;
+
+	/* Look at the record, like a parser would */
+	if (len > 0 && data[0] == '\n')
+		abort();
+}
+
+static void on_records(void* userdata, const struct aml_record* records,
+		size_t n)
+{
+	struct framing* self = userdata;
+
+	for (size_t i = 0; i < n; ++i)
+		on_record(self, records[i].data, records[i].len);
+}
+
+static void generate(struct framing* self, long record_size)
+{
+	srand(0);
+
+	for (size_t i = 0; i < self->size; ++i)
+		self->data[i] = 'a' + rand() % 26;
+
+	/* Record lengths vary between half and one and a half times the mean */
+	size_t pos = 0;
+	for (;;) {
+		pos += record_size / 2 + rand() % (record_size + 1);
+		if (pos >= self->size)
+			break;
+
+		self->data[pos++] = '\n';
+	}
+}
+
+static void scan_naive(struct framing* self)
+{
+	char* carry = malloc(1024 * 1024);
+	size_t carry_len = 0;
+	if (!carry)
+		abort();
+
+	for (size_t offset = 0; offset < self->size;
+			offset += self->chunk_size) {
+		const char* chunk = self->data + offset;
+		size_t len = self->size - offset;
+		if (len > self->chunk_size)
+			len = self->chunk_size;
+
+		size_t start = 0;
+		for (size_t i = 0; i < len; ++i) {
+			if (chunk[i] != '\n')
+				continue;
+
+			if (carry_len > 0) {
+				memcpy(carry + carry_len, chunk, i);
+				on_record(self, carry, carry_len + i);
+				carry_len = 0;
+			} else {
+				on_record(self, chunk + start, i - start);
+			}
+
+			start = i + 1;
+		}
+
+		memcpy(carry + carry_len, chunk + start, len - start);
+		carry_len += len - start;
+	}
+
+	free(carry);
+}
+
+static void scan_framer(struct framing* self)
+{
+	struct aml_framer* framer = aml_framer_new_delimited('\n', 0,
+			on_records, self);
+	if (!framer)
+		abort();
+
+	for (size_t offset = 0; offset < self->size;
+			offset += self->chunk_size) {
+		size_t len = self->size - offset;
+		if (len > self->chunk_size)
+			len = self->chunk_size;
+
+		if (aml_framer_feed(framer, self->data + offset, len) < 0)
+			abort();
+	}
+
+	aml_framer_del(framer);
+}
+
+static double measure(struct bench* bench, struct framing* self,
+		void (*scan)(struct framing*), long rounds)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (long i = 0; i < rounds; ++i) {
+		self->n_records = 0;
+		self->n_bytes = 0;
+
+		uint64_t start = bench_now_ns();
+		scan(self);
+		uint64_t elapsed = bench_now_ns() - start;
+
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	return (double)self->size / best;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "framing", argc, argv);
+
+	struct framing self = { 0 };
+	long record_size = bench_param(&bench, "record-size", 64);
+	self.size = bench_param(&bench, "megabytes", 64) * 1024 * 1024;
+	self.chunk_size = bench_param(&bench, "chunk-size", 65536);
+	long rounds = bench_param(&bench, "rounds", 5);
+
+	self.data = malloc(self.size);
+	if (!self.data)
+		return 1;
+
+	generate(&self, record_size);
+
+	double naive = measure(&bench, &self, scan_naive, rounds);
+	size_t naive_records = self.n_records;
+	size_t naive_bytes = self.n_bytes;
+
+	double framer = measure(&bench, &self, scan_framer, rounds);
+
+	if (self.n_records != naive_records || self.n_bytes != naive_bytes) {
+		fprintf(stderr, "Record mismatch: %zu/%zu vs %zu/%zu\n",
+				self.n_records, self.n_bytes, naive_records,
+				naive_bytes);
+		return 1;
+	}
+
+	bench_metric(&bench, "naive_gb_per_sec", naive);
+	bench_metric(&bench, "framer_gb_per_sec", framer);
+	bench_metric(&bench, "speedup", framer / naive);
+	bench_finish(&bench);
+
+	free(self.data);
+	return 0;
+}
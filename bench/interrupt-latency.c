@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* Another thread interrupts the loop while it's blocked in aml_poll() and
+ * the time it takes for aml_poll() to return is measured.
+ */
+
+struct interrupt_latency {
+	struct aml* aml;
+	long n_iterations;
+
+	atomic_uint_fast64_t sent_time;
+	atomic_int turn;
+};
+
+static void* interrupter(void* userdata)
+{
+	struct interrupt_latency* self = userdata;
+
+	for (long i = 0; i < self->n_iterations; ++i) {
+		/* Wait for the loop to go back to sleep */
+		while (atomic_load(&self->turn) != 1);
+
+		struct timespec ts = { .tv_nsec = 20000 };
+		nanosleep(&ts, NULL);
+
+		atomic_store(&self->turn, 0);
+		atomic_store(&self->sent_time, bench_now_ns());
+		aml_interrupt(self->aml);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "interrupt-latency", argc, argv);
+
+	struct interrupt_latency self = { 0 };
+	self.n_iterations = bench_param(&bench, "iterations", 10000);
+
+	uint64_t* samples = calloc(self.n_iterations, sizeof(*samples));
+	self.aml = bench_new_aml(&bench);
+	if (!self.aml || !samples)
+		return 1;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, interrupter, &self);
+
+	for (long i = 0; i < self.n_iterations; ++i) {
+		atomic_store(&self.sent_time, 0);
+		atomic_store(&self.turn, 1);
+
+		uint64_t sent, now;
+		do {
+			aml_poll(self.aml, -1);
+			now = bench_now_ns();
+			aml_dispatch(self.aml);
+			sent = atomic_load(&self.sent_time);
+		} while (sent == 0 || now < sent);
+
+		samples[i] = now - sent;
+	}
+
+	pthread_join(thread, NULL);
+
+	bench_samples(&bench, "latency_ns", samples, self.n_iterations);
+	bench_finish(&bench);
+
+	aml_unref(self.aml);
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <aml.h>
+
+#include "bench.h"
+
+struct ping_pong {
+	struct aml* aml;
+	int ping[2];
+	int pong[2];
+
+	long n_round_trips;
+	long count;
+
+	uint64_t start_time;
+	uint64_t* samples;
+};
+
+static void send_ping(struct ping_pong* self)
+{
+	char one = 1;
+	self->start_time = bench_now_ns();
+	if (write(self->ping[1], &one, 1) != 1)
+		abort();
+}
+
+static void on_ping(void* handler)
+{
+	struct ping_pong* self = aml_get_userdata(handler);
+
+	char c;
+	if (read(self->ping[0], &c, 1) != 1)
+		return;
+
+	if (write(self->pong[1], &c, 1) != 1)
+		abort();
+}
+
+static void on_pong(void* handler)
+{
+	struct ping_pong* self = aml_get_userdata(handler);
+
+	char c;
+	if (read(self->pong[0], &c, 1) != 1)
+		return;
+
+	self->samples[self->count++] = bench_now_ns() - self->start_time;
+
+	if (self->count < self->n_round_trips)
+		send_ping(self);
+	else
+		aml_exit(self->aml);
+}
+
+static int make_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+		return -1;
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "ping-pong", argc, argv);
+
+	struct ping_pong self = { 0 };
+	self.n_round_trips = bench_param(&bench, "round-trips", 100000);
+	self.samples = calloc(self.n_round_trips, sizeof(*self.samples));
+
+	self.aml = bench_new_aml(&bench);
+	if (!self.aml || !self.samples)
+		return 1;
+
+	if (make_pipe(self.ping) < 0 || make_pipe(self.pong) < 0)
+		return 1;
+
+	struct aml_handler* ping =
+		aml_handler_new(self.ping[0], on_ping, &self, NULL);
+	struct aml_handler* pong =
+		aml_handler_new(self.pong[0], on_pong, &self, NULL);
+
+	aml_start(self.aml, ping);
+	aml_start(self.aml, pong);
+
+	uint64_t start = bench_now_ns();
+	send_ping(&self);
+	aml_run(self.aml);
+	uint64_t elapsed = bench_now_ns() - start;
+
+	bench_metric(&bench, "round_trips_per_sec",
+			self.count * 1e9 / elapsed);
+	bench_samples(&bench, "latency_ns", self.samples, self.count);
+	bench_finish(&bench);
+
+	aml_stop(self.aml, pong);
+	aml_stop(self.aml, ping);
+	aml_unref(pong);
+	aml_unref(ping);
+	aml_unref(self.aml);
+	free(self.samples);
+	return 0;
+}
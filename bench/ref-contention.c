@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* Several threads take and drop references, either on one shared object or
+ * on an object of their own.
+ */
+
+struct ref_thread {
+	pthread_t thread;
+	void* obj;
+	long n_iterations;
+};
+
+static void* ref_unref(void* userdata)
+{
+	struct ref_thread* self = userdata;
+
+	for (long i = 0; i < self->n_iterations; ++i) {
+		aml_ref(self->obj);
+		aml_unref(self->obj);
+	}
+
+	return NULL;
+}
+
+static double run(long n_threads, long n_iterations, bool shared)
+{
+	struct ref_thread* threads = calloc(n_threads, sizeof(*threads));
+	if (!threads)
+		abort();
+
+	struct aml_idle* shared_obj = aml_idle_new(NULL, NULL, NULL);
+
+	for (long i = 0; i < n_threads; ++i) {
+		threads[i].obj = shared ? shared_obj :
+			aml_idle_new(NULL, NULL, NULL);
+		threads[i].n_iterations = n_iterations;
+	}
+
+	uint64_t start = bench_now_ns();
+
+	for (long i = 0; i < n_threads; ++i)
+		pthread_create(&threads[i].thread, NULL, ref_unref,
+				&threads[i]);
+
+	for (long i = 0; i < n_threads; ++i)
+		pthread_join(threads[i].thread, NULL);
+
+	uint64_t elapsed = bench_now_ns() - start;
+
+	for (long i = 0; i < n_threads; ++i)
+		if (threads[i].obj != shared_obj)
+			aml_unref(threads[i].obj);
+
+	aml_unref(shared_obj);
+	free(threads);
+
+	/* One iteration is a ref and an unref */
+	return (double)elapsed / (n_iterations * 2);
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "ref-contention", argc, argv);
+
+	long n_threads = bench_param(&bench, "threads", 4);
+	long n_iterations = bench_param(&bench, "iterations", 1000000);
+
+	bench_metric(&bench, "shared_ns_per_op",
+			run(n_threads, n_iterations, true));
+	bench_metric(&bench, "private_ns_per_op",
+			run(n_threads, n_iterations, false));
+	bench_finish(&bench);
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* Measures how far each tick strays from where it should have been */
+
+struct ticker_accuracy {
+	struct aml* aml;
+	long n_ticks;
+	long count;
+	uint64_t period_ns;
+	uint64_t start_time;
+	uint64_t* samples;
+};
+
+static void on_tick(void* ticker)
+{
+	struct ticker_accuracy* self = aml_get_userdata(ticker);
+
+	uint64_t now = bench_now_ns();
+	uint64_t expected = self->start_time +
+		(self->count + 1) * self->period_ns;
+
+	self->samples[self->count++] = now > expected ?
+		now - expected : expected - now;
+
+	if (self->count >= self->n_ticks)
+		aml_exit(self->aml);
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "ticker-accuracy", argc, argv);
+
+	struct ticker_accuracy self = { 0 };
+	long period_us = bench_param(&bench, "period-us", 1000);
+	self.n_ticks = bench_param(&bench, "ticks", 1000);
+	self.period_ns = period_us * UINT64_C(1000);
+
+	self.aml = bench_new_aml(&bench);
+	self.samples = calloc(self.n_ticks, sizeof(*self.samples));
+	if (!self.aml || !self.samples)
+		return 1;
+
+	struct aml_ticker* ticker =
+		aml_ticker_new(period_us, on_tick, &self, NULL);
+
+	self.start_time = bench_now_ns();
+	aml_start(self.aml, ticker);
+	aml_run(self.aml);
+
+	bench_samples(&bench, "error_ns", self.samples, self.count);
+	bench_finish(&bench);
+
+	aml_stop(self.aml, ticker);
+	aml_unref(ticker);
+	aml_unref(self.aml);
+	free(self.samples);
+	return 0;
+}
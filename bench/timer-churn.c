@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* A population of timers is kept running while timers are repeatedly
+ * stopped and restarted, like connection timeouts being refreshed.
+ *
+ * The virtual clock is used by default, so that reading the clock and arming
+ * the backend's timer doesn't add noise to the measurement.
+ */
+
+static uint64_t xorshift(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "timer-churn", argc, argv);
+
+	long n_timers = bench_param(&bench, "timers", 1000);
+	long n_ops = bench_param(&bench, "operations", 100000);
+	long virtual_clock = bench_param(&bench, "virtual-clock", 1);
+
+	struct aml* aml = bench_new_aml(&bench);
+	struct aml_timer** timers = calloc(n_timers, sizeof(*timers));
+	if (!aml || !timers)
+		return 1;
+
+	if (virtual_clock)
+		aml_use_virtual_clock(aml, 0);
+
+	uint64_t seed = 0x2545f4914f6cdd1d;
+
+	uint64_t start = bench_now_ns();
+
+	for (long i = 0; i < n_timers; ++i) {
+		uint64_t timeout = 60000000 + xorshift(&seed) % 60000000;
+		timers[i] = aml_timer_new(timeout, NULL, NULL, NULL);
+		aml_start(aml, timers[i]);
+	}
+
+	uint64_t populated = bench_now_ns();
+
+	for (long i = 0; i < n_ops; ++i) {
+		struct aml_timer* timer = timers[xorshift(&seed) % n_timers];
+		aml_stop(aml, timer);
+		aml_set_duration(timer, 60000000 + xorshift(&seed) % 60000000);
+		aml_start(aml, timer);
+	}
+
+	uint64_t churned = bench_now_ns();
+
+	for (long i = 0; i < n_timers; ++i)
+		aml_stop(aml, timers[i]);
+
+	uint64_t stopped = bench_now_ns();
+
+	bench_metric(&bench, "start_ns", (double)(populated - start) / n_timers);
+	bench_metric(&bench, "restart_ns", (double)(churned - populated) / n_ops);
+	bench_metric(&bench, "stop_ns", (double)(stopped - churned) / n_timers);
+	bench_finish(&bench);
+
+	for (long i = 0; i < n_timers; ++i)
+		aml_unref(timers[i]);
+
+	aml_unref(aml);
+	free(timers);
+	return 0;
+}
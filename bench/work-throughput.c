@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <aml.h>
+
+#include "bench.h"
+
+/* Trivial work items are kept in flight and the rate at which they are
+ * completed on the main loop is measured.
+ */
+
+struct work_throughput {
+	struct aml* aml;
+	long n_items;
+	long n_in_flight;
+
+	long submitted;
+	long completed;
+};
+
+static void do_work(void* work)
+{
+}
+
+static void submit(struct work_throughput* self);
+
+static void on_done(void* work)
+{
+	struct work_throughput* self = aml_get_userdata(work);
+
+	if (++self->completed >= self->n_items) {
+		aml_exit(self->aml);
+		return;
+	}
+
+	if (self->submitted < self->n_items)
+		submit(self);
+}
+
+static void submit(struct work_throughput* self)
+{
+	struct aml_work* work = aml_work_new(do_work, on_done, self, NULL);
+	if (!work)
+		abort();
+
+	aml_start(self->aml, work);
+	aml_unref(work);
+	self->submitted++;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	bench_init(&bench, "work-throughput", argc, argv);
+
+	struct work_throughput self = { 0 };
+	self.n_items = bench_param(&bench, "items", 100000);
+	self.n_in_flight = bench_param(&bench, "in-flight", 64);
+	long n_workers = bench_param(&bench, "workers", -1);
+
+	self.aml = bench_new_aml(&bench);
+	if (!self.aml)
+		return 1;
+
+	if (aml_require_workers(self.aml, n_workers) < 0)
+		return 1;
+
+	uint64_t start = bench_now_ns();
+
+	for (long i = 0; i < self.n_in_flight && i < self.n_items; ++i)
+		submit(&self);
+
+	aml_run(self.aml);
+
+	uint64_t elapsed = bench_now_ns() - start;
+
+	bench_metric(&bench, "items_per_sec", self.completed * 1e9 / elapsed);
+	bench_metric(&bench, "ns_per_item", (double)elapsed / self.completed);
+	bench_finish(&bench);
+
+	aml_unref(self.aml);
+	return 0;
+}
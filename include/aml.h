@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 struct aml;
 struct aml_handler;
@@ -38,6 +39,16 @@ struct aml_ticker;
 struct aml_signal;
 struct aml_work;
 struct aml_idle;
+struct aml_child;
+struct aml_fs_watch;
+struct aml_fs;
+struct aml_fsync_group;
+struct aml_mmap_reader;
+struct aml_framer;
+struct aml_buf_pool;
+struct aml_buf;
+struct aml_stream;
+struct stat;
 
 enum aml_event {
 	AML_EVENT_NONE = 0,
@@ -46,8 +57,95 @@ enum aml_event {
 	AML_EVENT_OOB = 1 << 2,
 };
 
+enum aml_flags {
+	AML_FLAGS_NONE = 0,
+	AML_SINGLE_THREADED = 1 << 0,
+};
+
+enum aml_stream_event {
+	AML_STREAM_READABLE = 1 << 0,
+	AML_STREAM_DRAINED = 1 << 1,
+	AML_STREAM_ERROR = 1 << 2,
+};
+
+enum aml_fs_event {
+	AML_FS_EVENT_NONE = 0,
+	/* The contents of the file have changed */
+	AML_FS_EVENT_MODIFY = 1 << 0,
+	/* Metadata, such as permissions or timestamps, has changed */
+	AML_FS_EVENT_ATTRIB = 1 << 1,
+	/* An entry was created in or moved into a watched directory */
+	AML_FS_EVENT_CREATE = 1 << 2,
+	/* An entry was deleted from or moved out of a watched directory */
+	AML_FS_EVENT_DELETE = 1 << 3,
+	/* The watched path itself was deleted or moved */
+	AML_FS_EVENT_DELETE_SELF = 1 << 4,
+	AML_FS_EVENT_ALL = (1 << 5) - 1,
+};
+
+enum aml_backend_type {
+	AML_BACKEND_DEFAULT = 0,
+	AML_BACKEND_EPOLL,
+	AML_BACKEND_KQUEUE,
+	AML_BACKEND_POSIX,
+};
+
+enum aml_phase {
+	AML_PHASE_POLL = 0,
+	AML_PHASE_TIMERS,
+	AML_PHASE_EVENTS,
+	AML_PHASE_IDLE,
+	AML_PHASE_MAX,
+};
+
+/* The value of a performance counter that could not be opened */
+#define AML_PERF_UNAVAILABLE UINT64_MAX
+
+struct aml_perf_counters {
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t cache_misses;
+	uint64_t branch_misses;
+	uint64_t context_switches;
+	uint64_t n_samples;
+};
+
+/* Information about a delivered signal. Fields that are not relevant to the
+ * signal or not reported by the backend are zero.
+ */
+struct aml_siginfo {
+	int signo;
+	int code;
+	int32_t pid;
+	uint32_t uid;
+	/* Exit status or signal number for SIGCHLD */
+	int32_t status;
+	/* The value passed to sigqueue() */
+	uint64_t value;
+};
+
+/* A reference counted view into an aml_buf */
+struct aml_slice {
+	struct aml_buf* buf;
+	size_t offset;
+	size_t len;
+};
+
+/* A view of a record inside a buffer owned by someone else */
+struct aml_record {
+	const void* data;
+	size_t len;
+};
+
 typedef void (*aml_callback_fn)(void* obj);
 typedef void (*aml_free_fn)(void*);
+typedef uint64_t (*aml_clock_fn)(void* userdata);
+typedef void (*aml_fs_callback_fn)(void* userdata, ssize_t result);
+typedef void (*aml_mmap_reader_fn)(void* userdata, uint64_t offset,
+                                   const void* data, size_t len);
+typedef void (*aml_stream_fn)(void* userdata, enum aml_stream_event events);
+typedef void (*aml_framer_fn)(void* userdata,
+                              const struct aml_record* records, size_t n);
 
 extern const char aml_version[];
 extern const int aml_unstable_abi_version;
@@ -55,6 +153,26 @@ extern const int aml_unstable_abi_version;
 /* Create a new main loop instance */
 struct aml* aml_new(void);
 
+/* Create a new main loop instance using a specific backend.
+ *
+ * The default backend is chosen at build time. The poll() based posix backend
+ * is available on all systems.
+ *
+ * Returns NULL if the backend is not available on this system.
+ */
+struct aml* aml_new_with_backend(enum aml_backend_type);
+
+/* Create a new main loop instance with flags.
+ *
+ * AML_SINGLE_THREADED: The main loop and its objects are only ever used from
+ * the thread that created it, so its internal locks are skipped and signals
+ * are not blocked during dispatch. Debug builds assert if another thread
+ * touches it. Other threads must use aml_post_start() and friends. Worker
+ * threads, and signals delivered through the posix backend, may still emit
+ * events to it; they are handed over through a lock-free queue.
+ */
+struct aml* aml_new_with_flags(enum aml_backend_type, enum aml_flags);
+
 /* The backend should supply a minimum of n worker threads in its thread pool.
  *
  * If n == -1, the backend should supply as many workers as there are available
@@ -85,7 +203,14 @@ int aml_run(struct aml*);
  */
 void aml_exit(struct aml*);
 
-/* Dispatch pending events */
+/* Dispatch pending events.
+ *
+ * Events for fd handlers that were found by the last aml_poll() on the main
+ * loop's own thread are dispatched first. After those, everything else is
+ * dispatched in the order it was emitted: timers that expire by the time
+ * aml_dispatch() is called, signals, work, children and fd events that were
+ * found some other way, e.g. by a nested loop's poller thread.
+ */
 void aml_dispatch(struct aml* self);
 
 /* Trigger an immediate return from aml_poll().
@@ -144,6 +269,31 @@ struct aml_work* aml_work_new(aml_callback_fn work_fn, aml_callback_fn done_fn,
 struct aml_idle* aml_idle_new(aml_callback_fn done_fn, void* userdata,
                               aml_free_fn);
 
+/* The callback of a child process watcher is called once when the child
+ * exits, after it has been reaped. The watcher is stopped before the callback
+ * is called.
+ *
+ * A pidfd is used to watch the child if the system supports it. Otherwise,
+ * SIGCHLD is handled by the main loop and each watched child is checked for
+ * with waitpid() when it arrives. Starting the watcher fails if the system
+ * reports that the process no longer exists.
+ */
+struct aml_child* aml_child_new(pid_t pid, aml_callback_fn, void* userdata,
+                                aml_free_fn);
+
+/* A file system watcher calls its callback when any of the events in mask
+ * happen to the file or directory at path. Events that happen before the
+ * callback gets to run are coalesced, so a file that is written many times
+ * only results in one callback. The events can be retrieved with
+ * aml_get_fs_events().
+ *
+ * All watchers of a main loop share one inotify instance. Starting a watcher
+ * fails if inotify is not available.
+ */
+struct aml_fs_watch* aml_fs_watch_new(const char* path, enum aml_fs_event mask,
+                                      aml_callback_fn, void* userdata,
+                                      aml_free_fn);
+
 /* Get the file descriptor associated with either a handler or the main loop.
  *
  * Calling this on objects of other types is illegal and may cause SIGABRT to
@@ -165,6 +315,17 @@ void* aml_get_userdata(const void* obj);
 void aml_set_event_mask(struct aml_handler* obj, enum aml_event mask);
 enum aml_event aml_get_event_mask(const struct aml_handler* obj);
 
+/* Stop delivering events to a handler without removing it from the main loop.
+ *
+ * This is cheaper than aml_stop() and aml_start() for flow control: nothing
+ * is done until an event actually arrives while the handler is paused, and
+ * only then is the fd masked in the backend. Events that are held back are
+ * delivered after aml_resume() if the fd is still ready.
+ */
+void aml_pause(struct aml_handler* obj);
+void aml_resume(struct aml_handler* obj);
+bool aml_is_paused(const struct aml_handler* obj);
+
 /* Check which events are pending on an fd event handler.
  */
 enum aml_event aml_get_revents(const struct aml_handler* obj);
@@ -195,6 +356,35 @@ int aml_start(struct aml*, void* obj);
  */
 int aml_stop(struct aml*, void* obj);
 
+/* Start or stop a number of objects at once, e.g. everything belonging to a
+ * connection. Each of the main loop's locks is taken once for the whole set
+ * and the timer deadline is updated at most once. Backends that support it
+ * are given all of the fd handlers in a single call when starting.
+ *
+ * aml_start_many() either starts all of the objects or none of them.
+ *
+ * Returns: 0 on success, -1 if any of the objects could not be started.
+ */
+int aml_start_many(struct aml*, void* const* objs, int n);
+int aml_stop_many(struct aml*, void* const* objs, int n);
+
+/* Start, stop or change the event mask of an object from another thread.
+ *
+ * The request is put on a lock-free queue and the main loop carries it out at
+ * the start of its next dispatch, waking up if needed. This is the only way
+ * for other threads to do these things to a single threaded main loop.
+ *
+ * A reference to the object is held until the request has been carried out.
+ * Whether aml_start() succeeded can be checked on the main loop's thread with
+ * aml_is_started().
+ *
+ * Returns: 0 on success or -1 if the request could not be queued.
+ */
+int aml_post_start(struct aml*, void* obj);
+int aml_post_stop(struct aml*, void* obj);
+int aml_post_set_event_mask(struct aml*, struct aml_handler*,
+                            enum aml_event mask);
+
 /* Check if an event handler is started.
  *
  * Returns: true if it has been started, false otherwise.
@@ -204,3 +394,365 @@ bool aml_is_started(struct aml*, void* obj);
 /* Get the signal assigned to a signal handler.
  */
 int aml_get_signo(const struct aml_signal* sig);
+
+/* Get the number of deliveries of the signal that were coalesced into the
+ * current callback.
+ *
+ * This is only meaningful inside the signal handler's callback.
+ */
+unsigned int aml_get_signal_count(const struct aml_signal* sig);
+
+/* Read up to max records of information about the deliveries that were
+ * coalesced into the current callback. Records that have been read are not
+ * returned again and those that are left unread are discarded after the
+ * callback returns.
+ *
+ * At most 32 records are kept for each callback, so the count may exceed the
+ * number of records. Only the epoll backend reports siginfo; other backends
+ * only report the count.
+ *
+ * Returns: the number of records that were read.
+ */
+int aml_signal_read_info(struct aml_signal* sig, struct aml_siginfo* out,
+                         int max);
+
+/* Get the process id of a child process watcher.
+ */
+pid_t aml_get_pid(const struct aml_child* child);
+
+/* Get the status of a child that has exited, as reported by waitpid(). Use
+ * WIFEXITED() and friends to decode it.
+ *
+ * The status is -1 if it is unknown because waitpid() failed, e.g. because the
+ * child was reaped by someone else.
+ */
+int aml_get_exit_status(const struct aml_child* child);
+
+/* Get the path that a file system watcher watches.
+ */
+const char* aml_get_fs_path(const struct aml_fs_watch* watch);
+
+/* Get the events that have been coalesced into the current callback of a file
+ * system watcher.
+ */
+enum aml_fs_event aml_get_fs_events(const struct aml_fs_watch* watch);
+
+/* Enable or disable sampling of hardware performance counters around each
+ * phase of aml_poll() and aml_dispatch().
+ *
+ * The counters are measured on the calling thread, so this must be called from
+ * the thread that runs the main loop. Only user space is counted by the
+ * hardware counters. Context switches happen in the kernel, so counting them
+ * requires perf_event_paranoid to be 1 or lower.
+ *
+ * Counters that the system doesn't allow to be opened are reported as
+ * AML_PERF_UNAVAILABLE by aml_get_perf_counters().
+ *
+ * Returns: 0 on success, -1 if no performance counter is available.
+ */
+int aml_enable_perf_counters(struct aml*, bool enable);
+
+/* Get the counters that have been accumulated for a phase since they were
+ * enabled or last reset.
+ */
+void aml_get_perf_counters(const struct aml*, enum aml_phase,
+                           struct aml_perf_counters* out);
+
+void aml_reset_perf_counters(struct aml*);
+
+/* Replace the clock that timers and tickers are measured against. The clock
+ * function must return a monotonic time in µs. Passing NULL restores the
+ * backend's clock.
+ *
+ * Deadlines are not handed to the backend while a custom clock is in use, so
+ * aml_poll() does not return when a timer expires. Instead, the user is
+ * expected to call aml_dispatch() whenever the clock has advanced.
+ *
+ * Timers and tickers that are already running keep the time that they have
+ * left, measured against the new clock.
+ */
+void aml_set_clock(struct aml*, aml_clock_fn, void* userdata);
+
+/* Use a virtual clock that only moves when aml_advance_clock() is called.
+ *
+ * This is intended for simulations and benchmarks: hours of timer traffic can
+ * be processed without sleeping by advancing the clock and calling
+ * aml_dispatch().
+ */
+void aml_use_virtual_clock(struct aml*, uint64_t start);
+
+/* Move the virtual clock forward by delta µs and interrupt aml_poll().
+ *
+ * This may be called from any thread.
+ *
+ * Returns: 0 on success or -1 if the main loop is not using the virtual clock.
+ */
+int aml_advance_clock(struct aml*, uint64_t delta);
+
+/* Get the current time of the main loop's clock in µs */
+uint64_t aml_get_time(struct aml*);
+
+/* Every object has a numeric id. Ids are assigned in order of creation, but
+ * they may be overridden so that objects can be matched up with a recording.
+ */
+unsigned long long aml_get_id(const void* obj);
+void aml_set_id(void* obj, unsigned long long id);
+
+/* Record every event that is dispatched by the main loop to a file.
+ *
+ * Each record holds the time of dispatch according to the loop's clock, the
+ * id and type of the object and the pending events for fd handlers. Records
+ * are buffered and are only guaranteed to be written after
+ * aml_record_stop().
+ *
+ * If a record can't be written, e.g. because the disk is full, recording ends
+ * there so that the log doesn't have holes in it. aml_record_stop() then
+ * reports the error.
+ *
+ * Returns: 0 on success, -1 on failure or if already recording.
+ */
+int aml_record_start(struct aml*, int fd);
+
+/* Returns: 0 if the whole recording was written or -1 with errno set if it
+ * was cut short.
+ */
+int aml_record_stop(struct aml*);
+
+/* Replay a recording made with aml_record_start() on a host with the same
+ * byte order.
+ *
+ * This switches the main loop to a virtual clock that starts at the time at
+ * which recording began. While replaying, objects are not registered with the
+ * backend or the thread pool and timers do not expire on their own: all
+ * events come from the log. Work functions are run on the main loop just
+ * before their done callbacks.
+ *
+ * Replay must be started before the objects that are to receive events are
+ * started. Events are delivered to started objects with matching ids.
+ *
+ * aml_replay_stop() switches back to the real clock, keeping the time that is
+ * left on each timer, and registers the objects that are still started, so
+ * that the main loop carries on with live events. Work that was started while
+ * replaying is handed to the thread pool at this point.
+ *
+ * Returns: 0 on success or -1 on failure. If an object could not be
+ * registered when stopping, it is stopped and -1 is returned.
+ */
+int aml_replay_start(struct aml*, int fd);
+int aml_replay_stop(struct aml*);
+
+/* Advance the virtual clock to the next recorded dispatch iteration and queue
+ * its events. The events are delivered by calling aml_dispatch().
+ *
+ * Returns: the number of events read, 0 at the end of the log or -1 if not
+ * replaying.
+ */
+int aml_replay_step(struct aml*);
+
+/* Asynchronous file system operations.
+ *
+ * Operations are executed on the thread pool and their callbacks are called
+ * from the main loop with the result of the system call: a file descriptor for
+ * open, the number of bytes transferred for pread and pwrite, zero for the
+ * rest or a negative errno value on failure.
+ *
+ * Requests are submitted from the main loop's thread. Buffers and paths must
+ * remain valid until the callback has been called. Requests are recycled, so
+ * no memory is allocated per operation once the context has warmed up, and
+ * requests that pile up while workers are busy are executed in batches.
+ */
+struct aml_fs* aml_fs_new(struct aml*);
+
+/* Delete a file system context. Requests that have not been started are
+ * dropped and callbacks are not called for requests that are in progress.
+ * This may be done from within a callback and must be done before the main
+ * loop is freed.
+ */
+void aml_fs_del(struct aml_fs*);
+
+/* The following submit requests.
+ *
+ * Returns: 0 on success or -1 if the request could not be queued.
+ */
+int aml_fs_open(struct aml_fs*, const char* path, int flags, int mode,
+                aml_fs_callback_fn, void* userdata);
+int aml_fs_close(struct aml_fs*, int fd, aml_fs_callback_fn, void* userdata);
+int aml_fs_pread(struct aml_fs*, int fd, void* buf, size_t len, off_t offset,
+                 aml_fs_callback_fn, void* userdata);
+int aml_fs_pwrite(struct aml_fs*, int fd, const void* buf, size_t len,
+                  off_t offset, aml_fs_callback_fn, void* userdata);
+int aml_fs_fsync(struct aml_fs*, int fd, aml_fs_callback_fn, void* userdata);
+int aml_fs_stat(struct aml_fs*, const char* path, struct stat* st,
+                aml_fs_callback_fn, void* userdata);
+int aml_fs_rename(struct aml_fs*, const char* old_path, const char* new_path,
+                  aml_fs_callback_fn, void* userdata);
+int aml_fs_unlink(struct aml_fs*, const char* path, aml_fs_callback_fn,
+                  void* userdata);
+
+/* A group commit helper for an fd, e.g. a write-ahead log.
+ *
+ * Sync requests that arrive while an fdatasync() is in progress are collected
+ * and all satisfied by the next single fdatasync() on a worker thread. The
+ * callback of each request is called from the main loop with 0 or a negative
+ * errno value once its data is durable.
+ *
+ * Requests may be submitted from any thread. The fd must remain open for as
+ * long as the group exists.
+ */
+struct aml_fsync_group* aml_fsync_group_new(struct aml*, int fd);
+
+/* Delete a group. Callbacks are not called for pending requests. This must be
+ * done before the main loop is freed.
+ */
+void aml_fsync_group_del(struct aml_fsync_group*);
+
+/* Returns: 0 on success or -1 if the request could not be queued.
+ */
+int aml_fsync_group_sync(struct aml_fsync_group*, aml_fs_callback_fn,
+                         void* userdata);
+
+/* Stream a file to the main loop through a read-only memory mapping.
+ *
+ * The file is handed to the callback in page aligned slices of slice_size
+ * bytes, or 1 MiB if slice_size is 0. A worker thread keeps a few slices
+ * ahead of the consumer resident using madvise() and readahead(), so that
+ * reading the slices on the main loop doesn't block on page faults. The end of
+ * the file is signalled by a call with a NULL slice of length 0.
+ *
+ * Slices are not copied and remain valid until the reader is deleted. The file
+ * must not be truncated while the reader exists. The reader may be deleted from
+ * within the callback to stop early.
+ */
+struct aml_mmap_reader* aml_mmap_reader_new(struct aml*, int fd,
+                                            size_t slice_size,
+                                            aml_mmap_reader_fn,
+                                            void* userdata);
+
+/* This must be done before the main loop is freed */
+void aml_mmap_reader_del(struct aml_mmap_reader*);
+
+int aml_mmap_reader_start(struct aml_mmap_reader*);
+
+/* Set the maximum number of slices that are delivered per main loop
+ * iteration. The default is 1 and 0 pauses delivery.
+ */
+void aml_mmap_reader_set_rate(struct aml_mmap_reader*, int rate);
+
+/* Split a byte stream into records.
+ *
+ * Records are handed to the callback in batches of views that point either
+ * into the data passed to aml_framer_feed() or into the framer's own buffer.
+ * They are only valid until the callback returns. Data is only copied when a
+ * record spans more than one call to aml_framer_feed().
+ *
+ * Delimited records do not include the delimiter. The delimiter is searched
+ * for using SSE2 or AVX2 where the CPU supports it.
+ *
+ * Length prefixed records start with a header_size byte big endian length,
+ * which may be 1, 2 or 4, and the header is not included in the record.
+ *
+ * Records longer than max_record_size, or 1 MiB if max_record_size is 0,
+ * are an error.
+ */
+struct aml_framer* aml_framer_new_delimited(char delimiter,
+                                            size_t max_record_size,
+                                            aml_framer_fn, void* userdata);
+struct aml_framer* aml_framer_new_length_prefixed(int header_size,
+                                                  size_t max_record_size,
+                                                  aml_framer_fn,
+                                                  void* userdata);
+
+void aml_framer_del(struct aml_framer*);
+
+/* The framer must not be deleted from within the callback.
+ *
+ * Returns: 0 on success or -1 on error. After an error, the framer cannot be
+ * used any more.
+ */
+int aml_framer_feed(struct aml_framer*, const void* data, size_t len);
+
+/* Read once from fd and frame the data in place. This is meant to be called
+ * from the callback of an aml_handler.
+ *
+ * Returns: the return value of read() or -1 if framing failed.
+ */
+ssize_t aml_framer_read(struct aml_framer*, int fd);
+
+/* Create a pool of fixed size, reference counted buffers.
+ *
+ * A pool is meant to be used by a single main loop: buffers should be
+ * allocated on the thread that created the pool, which then reuses them
+ * without locking. They may be released on any thread, e.g. after a worker or
+ * another loop is done with them, and are handed back to the owner through a
+ * lock-free list.
+ *
+ * Buffers are kept for reuse until the pool is deleted.
+ */
+struct aml_buf_pool* aml_buf_pool_new(size_t buf_size);
+
+/* Buffers that are still referenced remain valid and the pool is freed when
+ * the last one is released.
+ */
+void aml_buf_pool_del(struct aml_buf_pool*);
+
+/* Returns: a buffer with a reference count of 1 */
+struct aml_buf* aml_buf_new(struct aml_buf_pool*);
+
+void aml_buf_ref(struct aml_buf*);
+void aml_buf_unref(struct aml_buf*);
+
+void* aml_buf_data(struct aml_buf*);
+size_t aml_buf_size(const struct aml_buf*);
+
+/* Slices hold a reference to their buffer, so the same payload can be queued
+ * to any number of consumers without being copied. Each consumer releases its
+ * slice when done with it.
+ */
+struct aml_slice aml_slice_new(struct aml_buf*, size_t offset, size_t len);
+struct aml_slice aml_slice_dup(const struct aml_slice*);
+void aml_slice_release(struct aml_slice*);
+const void* aml_slice_data(const struct aml_slice*);
+
+/* Wrap a non-blocking stream fd, such as a socket, in a write queue.
+ *
+ * Writes are attempted immediately and interest in AML_EVENT_WRITE is only
+ * registered if the fd would block, so a response to a request usually goes
+ * out without an extra main loop iteration or event mask change.
+ *
+ * The callback is passed AML_STREAM_READABLE when the fd may be read from,
+ * AML_STREAM_DRAINED when queued data has all been written and
+ * AML_STREAM_ERROR when writing queued data failed. The stream may be deleted
+ * in the callback. The fd is not closed by the stream.
+ *
+ * The caller should ignore SIGPIPE.
+ */
+struct aml_stream* aml_stream_new(struct aml*, int fd, aml_stream_fn,
+                                  void* userdata);
+
+void aml_stream_del(struct aml_stream*);
+
+int aml_stream_start(struct aml_stream*);
+
+/* Deliver AML_STREAM_READABLE without waiting for the main loop to report
+ * the fd as readable. A newly accepted connection usually has a request
+ * waiting, so this saves a trip through the backend. If called from an event
+ * callback other than an idle callback, it is delivered during the same
+ * iteration.
+ */
+void aml_stream_read_now(struct aml_stream*);
+
+/* Write a slice or queue whatever could not be written right away. Queued
+ * data holds a reference to the slice's buffer.
+ *
+ * Returns: 0 on success or -1 on error. Once an error has occurred, all
+ * further writes fail.
+ */
+int aml_stream_write(struct aml_stream*, const struct aml_slice*);
+
+int aml_stream_get_fd(const struct aml_stream*);
+
+/* Returns: the number of bytes waiting to be written */
+size_t aml_stream_get_queued(const struct aml_stream*);
+
+/* Returns: the errno value of the write that failed or 0 */
+int aml_stream_get_error(const struct aml_stream*);
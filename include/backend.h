@@ -19,6 +19,7 @@
 #include <stdint.h>
 
 struct aml;
+struct aml_siginfo;
 struct aml_handler;
 struct aml_signal;
 struct aml_work;
@@ -48,6 +49,10 @@ struct aml_backend {
 	int (*thread_pool_acquire)(struct aml*, int n_threads);
 	void (*thread_pool_release)(struct aml*);
 	int (*thread_pool_enqueue)(struct aml*, struct aml_work*);
+	/* Optional. Add a number of handlers at once. Either all of them are
+	 * added or none of them.
+	 */
+	int (*add_fds)(void* state, struct aml_handler* const*, int n);
 };
 
 /* These are for setting random data required by the backend implementation.
@@ -64,11 +69,30 @@ void* aml_get_backend_state(const struct aml*);
  */
 aml_callback_fn aml_get_work_fn(const struct aml_work*);
 
+/* Get the events that the backend should watch for on a handler's fd. This
+ * differs from aml_get_event_mask() while the handler is paused.
+ */
+enum aml_event aml_get_active_event_mask(const struct aml_handler*);
+
 /* revents is only used for fd events. Zero otherwise.
- * This function may be called inside a signal handler
+ * This function may be called inside a signal handler, except for main loops
+ * that are single threaded.
  */
 void aml_emit(struct aml* self, void* obj, uint32_t revents);
 
+/* Queue information about count deliveries of a signal. This must be called
+ * before the signal is emitted. The info may be NULL if the backend doesn't
+ * have any.
+ */
+void aml_signal_queue_info(struct aml_signal*, const struct aml_siginfo* info,
+                           unsigned int count);
+
+/* Start an object from any thread. A single threaded main loop may only be
+ * touched by its own thread, so on other threads this goes through
+ * aml_post_start() and the object is started on the main loop's next dispatch.
+ */
+int aml_start_from_any_thread(struct aml*, void* obj);
+
 /* Get time in milliseconds until the next timeout event.
  *
  * If timeout is -1, this returns:
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum perf_counter {
+	PERF_COUNTER_CYCLES = 0,
+	PERF_COUNTER_INSTRUCTIONS,
+	PERF_COUNTER_CACHE_MISSES,
+	PERF_COUNTER_BRANCH_MISSES,
+	PERF_COUNTER_CONTEXT_SWITCHES,
+	PERF_COUNTER_MAX,
+};
+
+struct perf_group;
+
+/* Open a group of counters for the calling thread. Counters that are not
+ * available on the system read as zero.
+ *
+ * Returns NULL if no counter could be opened.
+ */
+struct perf_group* perf_group_new(void);
+void perf_group_del(struct perf_group*);
+
+/* Returns: true if the counter could be opened */
+bool perf_group_has_counter(const struct perf_group*, enum perf_counter);
+
+/* Read all counters in one go. */
+int perf_group_read(struct perf_group*, uint64_t values[PERF_COUNTER_MAX]);
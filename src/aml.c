@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
@@ -25,11 +26,19 @@
 #include <signal.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 #include "aml.h"
 #include "backend.h"
 #include "sys/queue.h"
 #include "thread-pool.h"
+#include "perf.h"
+#include "pidfd.h"
 
 #define EXPORT __attribute__((visibility("default")))
 
@@ -48,6 +57,8 @@ enum aml_obj_type {
 	AML_OBJ_SIGNAL,
 	AML_OBJ_WORK,
 	AML_OBJ_IDLE,
+	AML_OBJ_CHILD,
+	AML_OBJ_FS_WATCH,
 };
 
 struct aml_weak_ref {
@@ -59,7 +70,7 @@ LIST_HEAD(aml_weak_ref_list, aml_weak_ref);
 
 struct aml_obj {
 	enum aml_obj_type type;
-	int ref;
+	atomic_int ref;
 	void* userdata;
 	aml_free_fn free_fn;
 	aml_callback_fn cb;
@@ -69,13 +80,37 @@ struct aml_obj {
 
 	void* backend_data;
 
+	/* The main loop whose obj_list this is on */
+	struct aml* started_in;
+
 	LIST_ENTRY(aml_obj) link;
 	TAILQ_ENTRY(aml_obj) event_link;
+
+	/* Events emitted from other threads to a single threaded loop. The
+	 * object is on the loop's remote_events stack while the count is
+	 * non-zero.
+	 */
+	atomic_uint n_remote_events;
+	struct aml_obj* remote_next;
 };
 
 LIST_HEAD(aml_obj_list, aml_obj);
 TAILQ_HEAD(aml_obj_queue, aml_obj);
 
+enum aml__command_type {
+	AML__COMMAND_START,
+	AML__COMMAND_STOP,
+	AML__COMMAND_SET_EVENT_MASK,
+};
+
+/* A request from another thread to be carried out by the main loop */
+struct aml__command {
+	enum aml__command_type type;
+	struct aml_obj* obj;
+	enum aml_event mask;
+	struct aml__command* next;
+};
+
 struct aml_handler {
 	struct aml_obj obj;
 
@@ -83,6 +118,16 @@ struct aml_handler {
 	enum aml_event event_mask;
 	atomic_uint revents;
 
+	/* Internal handlers close their fd when they are freed */
+	bool owns_fd;
+
+	/* A paused handler stays registered. Its fd is only masked in the
+	 * backend once an event arrives while it's paused.
+	 */
+	bool paused;
+	bool masked;
+	uint32_t paused_revents;
+
 	struct aml* parent;
 };
 
@@ -98,16 +143,32 @@ struct aml_timer {
 
 LIST_HEAD(aml_timer_list, aml_timer);
 
+#define AML_SIGINFO_QUEUE_SIZE 32
+
 struct aml_signal {
 	struct aml_obj obj;
 
 	int signo;
+
+	/* Records between head and end belong to the current callback. The
+	 * ones after end are for the next one.
+	 */
+	pthread_mutex_t info_mutex;
+	unsigned int pending_count;
+	unsigned int count;
+	uint32_t info_head, info_end, info_tail;
+	struct aml_siginfo info[AML_SIGINFO_QUEUE_SIZE];
 };
 
 struct aml_work {
 	struct aml_obj obj;
 
 	aml_callback_fn work_fn;
+
+	/* Started while replaying, so it's handed to the thread pool when the
+	 * replay stops.
+	 */
+	bool deferred;
 };
 
 struct aml_idle {
@@ -118,12 +179,57 @@ struct aml_idle {
 
 LIST_HEAD(aml_idle_list, aml_idle);
 
+struct aml_child {
+	struct aml_obj obj;
+
+	pid_t pid;
+	int status;
+
+	/* Internal handler for the pidfd, or NULL if SIGCHLD is used */
+	struct aml_handler* pidfd_handler;
+
+	LIST_ENTRY(aml_child) link;
+};
+
+LIST_HEAD(aml_child_list, aml_child);
+
+struct aml_fs_watch {
+	struct aml_obj obj;
+
+	char* path;
+	enum aml_fs_event mask;
+
+	/* Watch descriptor or -1 if not added */
+	int wd;
+
+	/* Events that have arrived since the last callback */
+	atomic_uint pending;
+
+	/* Events for the current callback */
+	enum aml_fs_event events;
+
+	/* The kernel hands out the same watch descriptor for every watch of
+	 * the same inode, so those are chained together.
+	 */
+	struct aml_fs_watch* next;
+};
+
+/* Open addressing hash map from watch descriptors to chains of watchers */
+struct aml_fs_watch_map {
+	struct aml_fs_watch** slots;
+	uint32_t cap;
+	uint32_t len;
+};
+
 struct aml {
 	struct aml_obj obj;
 
 	void* state;
 	struct aml_backend backend;
 
+	enum aml_flags flags;
+	pthread_t owner;
+
 	int self_pipe_rfd, self_pipe_wfd;
 
 	bool do_exit;
@@ -136,18 +242,73 @@ struct aml {
 
 	struct aml_idle_list idle_list;
 
+	/* Children that are watched via SIGCHLD because pidfds are missing */
+	struct aml_child_list child_list;
+	pthread_mutex_t child_list_mutex;
+	struct aml_signal* sigchld;
+
+	struct aml_handler* inotify_handler;
+	struct aml_fs_watch_map fs_watches;
+	pthread_mutex_t fs_watch_mutex;
+
 	struct aml_obj_queue event_queue;
 	pthread_mutex_t event_queue_mutex;
 
+	/* Handler events emitted by the backend while it's being polled on
+	 * the loop's own thread. These are dispatched before the queue.
+	 */
+	struct aml_obj** direct_events;
+	size_t n_direct_events;
+	size_t direct_events_head;
+	size_t direct_events_cap;
+
+	/* Lock-free stacks that other threads push onto and the loop takes
+	 * as a whole. remote_events is only used by single threaded loops.
+	 */
+	_Atomic(struct aml_obj*) remote_events;
+	_Atomic(struct aml__command*) commands;
+
 	bool have_thread_pool;
+
+	aml_clock_fn clock_fn;
+	void* clock_userdata;
+	atomic_uint_fast64_t virtual_time;
+
+	FILE* record_file;
+	bool record_new_iteration;
+	int record_error;
+
+	struct aml__replay* replay;
+
+	struct perf_group* perf;
+	uint64_t perf_last[PERF_COUNTER_MAX];
+	bool perf_available[PERF_COUNTER_MAX];
+	struct aml_perf_counters perf_counters[AML_PHASE_MAX];
 };
 
 static struct aml* aml__default = NULL;
 
-// TODO: Properly initialise this?
-static pthread_mutex_t aml__ref_mutex;
+/* The main loop whose backend is being polled on this thread, if any */
+static _Thread_local struct aml* aml__polling = NULL;
+
+static atomic_ullong aml__last_id = 0;
 
-extern struct aml_backend implementation;
+/* Protects weak references */
+static pthread_mutex_t aml__ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_EPOLL
+extern const struct aml_backend epoll_backend;
+#endif
+#ifdef HAVE_KQUEUE
+extern const struct aml_backend kqueue_backend;
+#endif
+extern const struct aml_backend posix_backend;
+
+#define AML_DIRECT_EVENTS_MIN 64
+
+#ifndef AML_DEFAULT_BACKEND
+#define AML_DEFAULT_BACKEND AML_BACKEND_POSIX
+#endif
 
 static struct aml_timer* aml__get_timer_with_earliest_deadline(struct aml* self);
 
@@ -161,6 +322,11 @@ EXPORT const char aml_version[] = "UNKNOWN";
 
 EXPORT const int aml_unstable_abi_version = AML_UNSTABLE_API;
 
+static unsigned long long aml__new_id(void)
+{
+	return atomic_fetch_add(&aml__last_id, 1) + 1;
+}
+
 EXPORT
 void aml_set_default(struct aml* aml)
 {
@@ -175,7 +341,14 @@ struct aml* aml_get_default(void)
 
 static int aml__poll(struct aml* self, int timeout)
 {
-	return self->backend.poll(self->state, timeout);
+	/* Loops may be nested, so the outer one is restored afterwards */
+	struct aml* outer = aml__polling;
+	aml__polling = self;
+
+	int rc = self->backend.poll(self->state, timeout);
+
+	aml__polling = outer;
+	return rc;
 }
 
 static int aml__add_fd(struct aml* self, struct aml_handler* handler)
@@ -200,6 +373,10 @@ static int aml__mod_fd(struct aml* self, struct aml_handler* handler)
 
 static int aml__set_deadline(struct aml* self, uint64_t deadline)
 {
+	/* The backend only knows its own clock */
+	if (self->clock_fn)
+		return 0;
+
 	return self->backend.set_deadline(self->state, deadline);
 }
 
@@ -216,11 +393,74 @@ static void aml__dont_block(int fd)
 
 static uint64_t aml__gettime_us(struct aml* self)
 {
+	if (self->clock_fn)
+		return self->clock_fn(self->clock_userdata);
+
 	struct timespec ts = { 0 };
 	clock_gettime(self->backend.clock, &ts);
 	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
 }
 
+static void aml__perf_start(struct aml* self)
+{
+	if (self->perf)
+		perf_group_read(self->perf, self->perf_last);
+}
+
+/* Attribute everything counted since the last mark to the given phase */
+static void aml__perf_mark(struct aml* self, enum aml_phase phase)
+{
+	if (!self->perf)
+		return;
+
+	uint64_t now[PERF_COUNTER_MAX];
+	if (perf_group_read(self->perf, now) < 0)
+		return;
+
+	uint64_t delta[PERF_COUNTER_MAX];
+	for (int i = 0; i < PERF_COUNTER_MAX; ++i) {
+		delta[i] = now[i] - self->perf_last[i];
+		self->perf_last[i] = now[i];
+	}
+
+	struct aml_perf_counters* counters = &self->perf_counters[phase];
+	counters->cycles += delta[PERF_COUNTER_CYCLES];
+	counters->instructions += delta[PERF_COUNTER_INSTRUCTIONS];
+	counters->cache_misses += delta[PERF_COUNTER_CACHE_MISSES];
+	counters->branch_misses += delta[PERF_COUNTER_BRANCH_MISSES];
+	counters->context_switches += delta[PERF_COUNTER_CONTEXT_SWITCHES];
+	counters->n_samples++;
+}
+
+static bool aml__is_single_threaded(const struct aml* self)
+{
+	return self->flags & AML_SINGLE_THREADED;
+}
+
+static bool aml__is_owner(const struct aml* self)
+{
+	return pthread_equal(pthread_self(), self->owner);
+}
+
+/* Locks that only protect the main loop's own state are skipped when it is
+ * single threaded.
+ */
+static void aml__lock(struct aml* self, pthread_mutex_t* mutex)
+{
+	if (aml__is_single_threaded(self)) {
+		assert(aml__is_owner(self));
+		return;
+	}
+
+	pthread_mutex_lock(mutex);
+}
+
+static void aml__unlock(struct aml* self, pthread_mutex_t* mutex)
+{
+	if (!aml__is_single_threaded(self))
+		pthread_mutex_unlock(mutex);
+}
+
 static void aml__ref_lock(void)
 {
 	pthread_mutex_lock(&aml__ref_mutex);
@@ -266,8 +506,21 @@ void* aml_weak_ref_read(struct aml_weak_ref* self)
 {
 	aml__ref_lock();
 	struct aml_obj* obj = self->obj;
-	if (obj)
-		obj->ref++;
+
+	/* The object may be on its way out, in which case it must not be
+	 * brought back.
+	 */
+	if (obj) {
+		int ref = atomic_load(&obj->ref);
+		do {
+			if (ref == 0) {
+				obj = NULL;
+				break;
+			}
+		} while (!atomic_compare_exchange_weak(&obj->ref, &ref,
+					ref + 1));
+	}
+
 	aml__ref_unlock();
 	return obj;
 }
@@ -333,27 +586,78 @@ void aml_interrupt(struct aml* self)
 	write(self->self_pipe_wfd, &one, sizeof(one));
 }
 
+static const struct aml_backend* aml__get_backend(enum aml_backend_type type)
+{
+	if (type == AML_BACKEND_DEFAULT)
+		type = AML_DEFAULT_BACKEND;
+
+	switch (type) {
+#ifdef HAVE_EPOLL
+	case AML_BACKEND_EPOLL: return &epoll_backend;
+#endif
+#ifdef HAVE_KQUEUE
+	case AML_BACKEND_KQUEUE: return &kqueue_backend;
+#endif
+	case AML_BACKEND_POSIX: return &posix_backend;
+	default:;
+	}
+
+	return NULL;
+}
+
 EXPORT
 struct aml* aml_new(void)
 {
+	return aml_new_with_backend(AML_BACKEND_DEFAULT);
+}
+
+EXPORT
+struct aml* aml_new_with_backend(enum aml_backend_type type)
+{
+	return aml_new_with_flags(type, AML_FLAGS_NONE);
+}
+
+EXPORT
+struct aml* aml_new_with_flags(enum aml_backend_type type,
+		enum aml_flags flags)
+{
+	const struct aml_backend* backend = aml__get_backend(type);
+	if (!backend)
+		return NULL;
+
 	struct aml* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
 	self->obj.type = AML_OBJ_AML;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	LIST_INIT(&self->obj.weak_refs);
 
+	self->flags = flags;
+	self->owner = pthread_self();
+
 	LIST_INIT(&self->obj_list);
 	LIST_INIT(&self->timer_list);
 	LIST_INIT(&self->idle_list);
+	LIST_INIT(&self->child_list);
 	TAILQ_INIT(&self->event_queue);
+	atomic_init(&self->remote_events, NULL);
+	atomic_init(&self->commands, NULL);
+
+	self->direct_events = malloc(AML_DIRECT_EVENTS_MIN *
+			sizeof(*self->direct_events));
+	if (!self->direct_events)
+		goto failure;
+	self->direct_events_cap = AML_DIRECT_EVENTS_MIN;
 
 	pthread_mutex_init(&self->event_queue_mutex, NULL);
 	pthread_mutex_init(&self->obj_list_mutex, NULL);
 	pthread_mutex_init(&self->timer_list_mutex, NULL);
+	pthread_mutex_init(&self->child_list_mutex, NULL);
+	pthread_mutex_init(&self->fs_watch_mutex, NULL);
 
-	memcpy(&self->backend, &implementation, sizeof(self->backend));
+	memcpy(&self->backend, backend, sizeof(self->backend));
 
 	if (!self->backend.thread_pool_acquire)
 		self->backend.thread_pool_acquire = thread_pool_acquire_default;
@@ -374,6 +678,7 @@ struct aml* aml_new(void)
 pipe_failure:
 	self->backend.del_state(self->state);
 failure:
+	free(self->direct_events);
 	free(self);
 	return NULL;
 }
@@ -410,6 +715,7 @@ struct aml_handler* aml_handler_new(int fd, aml_callback_fn callback,
 
 	self->obj.type = AML_OBJ_HANDLER;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	self->obj.userdata = userdata;
 	self->obj.free_fn = free_fn;
 	self->obj.cb = callback;
@@ -431,6 +737,7 @@ struct aml_timer* aml_timer_new(uint64_t timeout, aml_callback_fn callback,
 
 	self->obj.type = AML_OBJ_TIMER;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	self->obj.userdata = userdata;
 	self->obj.free_fn = free_fn;
 	self->obj.cb = callback;
@@ -461,12 +768,14 @@ struct aml_signal* aml_signal_new(int signo, aml_callback_fn callback,
 
 	self->obj.type = AML_OBJ_SIGNAL;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	self->obj.userdata = userdata;
 	self->obj.free_fn = free_fn;
 	self->obj.cb = callback;
 	LIST_INIT(&self->obj.weak_refs);
 
 	self->signo = signo;
+	pthread_mutex_init(&self->info_mutex, NULL);
 
 	return self;
 }
@@ -481,6 +790,7 @@ struct aml_work* aml_work_new(aml_callback_fn work_fn, aml_callback_fn callback,
 
 	self->obj.type = AML_OBJ_WORK;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	self->obj.userdata = userdata;
 	self->obj.free_fn = free_fn;
 	self->obj.cb = callback;
@@ -501,11 +811,62 @@ struct aml_idle* aml_idle_new(aml_callback_fn callback, void* userdata,
 
 	self->obj.type = AML_OBJ_IDLE;
 	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
+	self->obj.userdata = userdata;
+	self->obj.free_fn = free_fn;
+	self->obj.cb = callback;
+	LIST_INIT(&self->obj.weak_refs);
+
+	return self;
+}
+
+EXPORT
+struct aml_child* aml_child_new(pid_t pid, aml_callback_fn callback,
+                                void* userdata, aml_free_fn free_fn)
+{
+	struct aml_child* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->obj.type = AML_OBJ_CHILD;
+	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
+	self->obj.userdata = userdata;
+	self->obj.free_fn = free_fn;
+	self->obj.cb = callback;
+	LIST_INIT(&self->obj.weak_refs);
+
+	self->pid = pid;
+
+	return self;
+}
+
+EXPORT
+struct aml_fs_watch* aml_fs_watch_new(const char* path, enum aml_fs_event mask,
+                                      aml_callback_fn callback, void* userdata,
+                                      aml_free_fn free_fn)
+{
+	struct aml_fs_watch* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->obj.type = AML_OBJ_FS_WATCH;
+	self->obj.ref = 1;
+	self->obj.id = aml__new_id();
 	self->obj.userdata = userdata;
 	self->obj.free_fn = free_fn;
 	self->obj.cb = callback;
 	LIST_INIT(&self->obj.weak_refs);
 
+	self->path = strdup(path);
+	if (!self->path) {
+		free(self);
+		return NULL;
+	}
+
+	self->mask = mask;
+	self->wd = -1;
+
 	return self;
 }
 
@@ -514,6 +875,7 @@ static bool aml__obj_is_single_shot(void* ptr)
 	struct aml_obj* obj = ptr;
 	switch (obj->type) {
 	case AML_OBJ_TIMER: /* fallthrough */
+	case AML_OBJ_CHILD: /* fallthrough */
 	case AML_OBJ_WORK:
 		return true;
 	default:;
@@ -523,72 +885,86 @@ static bool aml__obj_is_single_shot(void* ptr)
 
 static bool aml__obj_is_started_unlocked(struct aml* self, void* obj)
 {
-	struct aml_obj* elem;
-	LIST_FOREACH(elem, &self->obj_list, link)
-		if (elem == obj)
-			return true;
-
-	return false;
+	return ((struct aml_obj*)obj)->started_in == self;
 }
 
 EXPORT
 bool aml_is_started(struct aml* self, void* obj)
 {
-	pthread_mutex_lock(&self->obj_list_mutex);
+	aml__lock(self, &self->obj_list_mutex);
 	bool result = aml__obj_is_started_unlocked(self, obj);
-	pthread_mutex_unlock(&self->obj_list_mutex);
+	aml__unlock(self, &self->obj_list_mutex);
 	return result;
 }
 
+static void aml__obj_add_unlocked(struct aml* self, void* ptr)
+{
+	struct aml_obj* obj = ptr;
+
+	aml_ref(obj);
+	LIST_INSERT_HEAD(&self->obj_list, obj, link);
+	obj->started_in = self;
+}
+
 static int aml__obj_try_add(struct aml* self, void* obj)
 {
 	int rc = -1;
 
-	pthread_mutex_lock(&self->obj_list_mutex);
+	aml__lock(self, &self->obj_list_mutex);
 
 	if (!aml__obj_is_started_unlocked(self, obj)) {
-		aml_ref(obj);
-		LIST_INSERT_HEAD(&self->obj_list, (struct aml_obj*)obj, link);
+		aml__obj_add_unlocked(self, obj);
 		rc = 0;
 	}
 
-	pthread_mutex_unlock(&self->obj_list_mutex);
+	aml__unlock(self, &self->obj_list_mutex);
 
 	return rc;
 }
 
-static void aml__obj_remove_unlocked(struct aml* self, void* obj)
+static void aml__obj_remove_unlocked(struct aml* self, void* ptr)
 {
-	LIST_REMOVE((struct aml_obj*)obj, link);
+	struct aml_obj* obj = ptr;
+
+	LIST_REMOVE(obj, link);
+	obj->started_in = NULL;
 	aml_unref(obj);
 }
 
 static void aml__obj_remove(struct aml* self, void* obj)
 {
-	pthread_mutex_lock(&self->obj_list_mutex);
+	aml__lock(self, &self->obj_list_mutex);
 	aml__obj_remove_unlocked(self, obj);
-	pthread_mutex_unlock(&self->obj_list_mutex);
+	aml__unlock(self, &self->obj_list_mutex);
 }
 
 static int aml__obj_try_remove(struct aml* self, void* obj)
 {
 	int rc = -1;
 
-	pthread_mutex_lock(&self->obj_list_mutex);
+	aml__lock(self, &self->obj_list_mutex);
 
 	if (aml__obj_is_started_unlocked(self, obj)) {
 		aml__obj_remove_unlocked(self, obj);
 		rc = 0;
 	}
 
-	pthread_mutex_unlock(&self->obj_list_mutex);
+	aml__unlock(self, &self->obj_list_mutex);
 
 	return rc;
 }
 
+/* While replaying, events only come from the log, so nothing is registered
+ * with the backend or the thread pool.
+ */
+static bool aml__is_replaying(struct aml* self)
+{
+	return self->replay != NULL;
+}
+
 static int aml__start_handler(struct aml* self, struct aml_handler* handler)
 {
-	if (aml__add_fd(self, handler) < 0)
+	if (!aml__is_replaying(self) && aml__add_fd(self, handler) < 0)
 		return -1;
 
 	handler->parent = self;
@@ -596,18 +972,40 @@ static int aml__start_handler(struct aml* self, struct aml_handler* handler)
 	return 0;
 }
 
-static int aml__start_timer(struct aml* self, struct aml_timer* timer)
+static void aml__timer_insert_unlocked(struct aml* self,
+		struct aml_timer* timer, uint64_t now)
 {
-	timer->deadline = aml__gettime_us(self) + timer->timeout;
+	timer->deadline = now + timer->timeout;
 	timer->expired = false;
-
-	pthread_mutex_lock(&self->timer_list_mutex);
 	LIST_INSERT_HEAD(&self->timer_list, timer, link);
-	pthread_mutex_unlock(&self->timer_list_mutex);
+}
+
+/* Returns: true if the timer has already expired and the loop needs to be
+ * interrupted.
+ */
+static bool aml__timer_emit_if_expired(struct aml* self,
+		struct aml_timer* timer)
+{
+	if (timer->timeout != 0)
+		return false;
+
+	assert(timer->obj.type != AML_OBJ_TICKER);
+	if (aml__is_replaying(self))
+		return false;
+
+	aml_emit(self, timer, 0);
+	return true;
+}
+
+static int aml__start_timer(struct aml* self, struct aml_timer* timer)
+{
+	uint64_t now = aml__gettime_us(self);
+
+	aml__lock(self, &self->timer_list_mutex);
+	aml__timer_insert_unlocked(self, timer, now);
+	aml__unlock(self, &self->timer_list_mutex);
 
-	if (timer->timeout == 0) {
-		assert(timer->obj.type != AML_OBJ_TICKER);
-		aml_emit(self, timer, 0);
+	if (aml__timer_emit_if_expired(self, timer)) {
 		aml_interrupt(self);
 		return 0;
 	}
@@ -621,11 +1019,19 @@ static int aml__start_timer(struct aml* self, struct aml_timer* timer)
 
 static int aml__start_signal(struct aml* self, struct aml_signal* sig)
 {
+	if (aml__is_replaying(self))
+		return 0;
+
 	return self->backend.add_signal(self->state, sig);
 }
 
 static int aml__start_work(struct aml* self, struct aml_work* work)
 {
+	if (aml__is_replaying(self)) {
+		work->deferred = true;
+		return 0;
+	}
+
 	return self->backend.thread_pool_enqueue(self, work);
 }
 
@@ -635,84 +1041,525 @@ static int aml__start_idle(struct aml* self, struct aml_idle* idle)
 	return 0;
 }
 
-static int aml__start_unchecked(struct aml* self, void* obj)
+/* Returns: true if the child has exited or can't be waited for */
+static bool aml__child_try_reap(struct aml_child* child)
 {
-	struct aml_obj* head = obj;
+	pid_t rc;
+	do
+		rc = waitpid(child->pid, &child->status, WNOHANG);
+	while (rc < 0 && errno == EINTR);
 
-	switch (head->type) {
-	case AML_OBJ_AML: return -1;
-	case AML_OBJ_HANDLER: return aml__start_handler(self, obj);
-	case AML_OBJ_TIMER: /* fallthrough */
-	case AML_OBJ_TICKER: return aml__start_timer(self, obj);
-	case AML_OBJ_SIGNAL: return aml__start_signal(self, obj);
-	case AML_OBJ_WORK: return aml__start_work(self, obj);
-	case AML_OBJ_IDLE: return aml__start_idle(self, obj);
-	case AML_OBJ_UNSPEC: break;
+	/* It was reaped elsewhere or isn't our child, so waiting any longer
+	 * won't get us anywhere.
+	 */
+	if (rc < 0) {
+		child->status = -1;
+		return true;
 	}
 
-	abort();
-	return -1;
+	return rc == child->pid;
 }
 
-EXPORT
-int aml_start(struct aml* self, void* obj)
+static void aml__child_on_pidfd(void* obj)
 {
-	if (aml__obj_try_add(self, obj) < 0)
-		return -1;
+	struct aml_handler* handler = obj;
+	struct aml_child* child = aml_get_userdata(handler);
+	struct aml* self = handler->parent;
 
-	if (aml__start_unchecked(self, obj) == 0)
-		return 0;
+	if (!aml__child_try_reap(child))
+		return;
 
-	aml__obj_remove(self, obj);
-	return -1;
+	aml_stop(self, handler);
+	aml_emit(self, child, 0);
 }
 
-static int aml__stop_handler(struct aml* self, struct aml_handler* handler)
+static void aml__on_sigchld(void* obj)
+{
+	struct aml* self = aml_get_userdata(obj);
+	struct aml_child* child;
+	struct aml_child* tmp;
+
+	aml__lock(self, &self->child_list_mutex);
+	LIST_FOREACH_SAFE(child, &self->child_list, link, tmp)
+		if (aml__child_try_reap(child)) {
+			LIST_REMOVE(child, link);
+			child->link.le_prev = NULL;
+			aml_emit(self, child, 0);
+		}
+	aml__unlock(self, &self->child_list_mutex);
+}
+
+static int aml__start_child_pidfd(struct aml* self, struct aml_child* child)
 {
-	if (aml__del_fd(self, handler) < 0)
+	int fd = pidfd_open_child(child->pid);
+	if (fd < 0)
 		return -1;
 
-	handler->parent = NULL;
+	struct aml_handler* handler = aml_handler_new(fd, aml__child_on_pidfd,
+			child, NULL);
+	if (!handler) {
+		close(fd);
+		return -1;
+	}
+
+	/* The fd lives as long as the handler so that it's never closed while
+	 * the backend might still be polling it.
+	 */
+	handler->owns_fd = true;
 
+	if (aml_start(self, handler) < 0) {
+		aml_unref(handler);
+		return -1;
+	}
+
+	child->pidfd_handler = handler;
 	return 0;
 }
 
-static int aml__stop_timer(struct aml* self, struct aml_timer* timer)
+static int aml__start_child_sigchld(struct aml* self, struct aml_child* child)
 {
-	pthread_mutex_lock(&self->timer_list_mutex);
-	LIST_REMOVE(timer, link);
-	pthread_mutex_unlock(&self->timer_list_mutex);
+	aml__lock(self, &self->child_list_mutex);
+
+	if (!self->sigchld) {
+		self->sigchld = aml_signal_new(SIGCHLD, aml__on_sigchld, self,
+				NULL);
+		if (!self->sigchld || aml_start(self, self->sigchld) < 0)
+			goto failure;
+	}
+
+	LIST_INSERT_HEAD(&self->child_list, child, link);
+	aml__unlock(self, &self->child_list_mutex);
+
+	/* The child may have exited before SIGCHLD was being handled */
+	aml__on_sigchld(self->sigchld);
 	return 0;
+
+failure:
+	if (self->sigchld)
+		aml_unref(self->sigchld);
+	self->sigchld = NULL;
+	aml__unlock(self, &self->child_list_mutex);
+	return -1;
 }
 
-static int aml__stop_signal(struct aml* self, struct aml_signal* sig)
+static int aml__start_child(struct aml* self, struct aml_child* child)
 {
-	return self->backend.del_signal(self->state, sig);
+	if (aml__is_replaying(self))
+		return 0;
+
+	if (aml__start_child_pidfd(self, child) == 0)
+		return 0;
+
+	/* The process is already gone, so no SIGCHLD is coming for it */
+	if (errno == ESRCH)
+		return -1;
+
+	return aml__start_child_sigchld(self, child);
 }
 
-static int aml__stop_work(struct aml* self, struct aml_work* work)
+static uint32_t aml__fs_watch_map_index(const struct aml_fs_watch_map* map,
+		int wd)
 {
-	return 0;
+	return ((uint32_t)wd * UINT32_C(2654435761)) & (map->cap - 1);
 }
 
-static int aml__stop_idle(struct aml* self, struct aml_idle* idle)
+/* Returns the slot that holds wd or the empty slot where it belongs */
+static struct aml_fs_watch** aml__fs_watch_map_slot(
+		struct aml_fs_watch_map* map, int wd)
 {
-	LIST_REMOVE(idle, link);
-	return 0;
+	uint32_t i = aml__fs_watch_map_index(map, wd);
+	while (map->slots[i] && map->slots[i]->wd != wd)
+		i = (i + 1) & (map->cap - 1);
+	return &map->slots[i];
 }
 
-static int aml__stop_unchecked(struct aml* self, void* obj)
+static struct aml_fs_watch* aml__fs_watch_map_find(
+		struct aml_fs_watch_map* map, int wd)
 {
-	struct aml_obj* head = obj;
+	return map->cap ? *aml__fs_watch_map_slot(map, wd) : NULL;
+}
 
-	switch (head->type) {
-	case AML_OBJ_AML: return -1;
-	case AML_OBJ_HANDLER: return aml__stop_handler(self, obj);
-	case AML_OBJ_TIMER: /* fallthrough */
+static int aml__fs_watch_map_grow(struct aml_fs_watch_map* map)
+{
+	struct aml_fs_watch_map new_map = {
+		.cap = map->cap ? map->cap * 2 : 64,
+		.len = map->len,
+	};
+
+	new_map.slots = calloc(new_map.cap, sizeof(*new_map.slots));
+	if (!new_map.slots)
+		return -1;
+
+	for (uint32_t i = 0; i < map->cap; ++i)
+		if (map->slots[i])
+			*aml__fs_watch_map_slot(&new_map, map->slots[i]->wd) =
+				map->slots[i];
+
+	free(map->slots);
+	*map = new_map;
+	return 0;
+}
+
+/* Sets the chain for wd, which must not be empty */
+static int aml__fs_watch_map_set(struct aml_fs_watch_map* map,
+		struct aml_fs_watch* head)
+{
+	if ((map->len + 1) * 2 > map->cap && aml__fs_watch_map_grow(map) < 0)
+		return -1;
+
+	struct aml_fs_watch** slot = aml__fs_watch_map_slot(map, head->wd);
+	if (!*slot)
+		map->len++;
+
+	*slot = head;
+	return 0;
+}
+
+static void aml__fs_watch_map_remove(struct aml_fs_watch_map* map, int wd)
+{
+	if (!map->cap)
+		return;
+
+	struct aml_fs_watch** slot = aml__fs_watch_map_slot(map, wd);
+	if (!*slot)
+		return;
+
+	/* Entries that follow are shifted back so that lookups never stop
+	 * early at the freed slot.
+	 */
+	uint32_t mask = map->cap - 1;
+	uint32_t i = slot - map->slots;
+	uint32_t j = i;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (!map->slots[j])
+			break;
+
+		uint32_t k = aml__fs_watch_map_index(map, map->slots[j]->wd);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+
+	map->slots[i] = NULL;
+	map->len--;
+}
+
+#ifdef HAVE_INOTIFY
+#define AML__INOTIFY_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+		IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | \
+		IN_DELETE_SELF | IN_MOVE_SELF)
+
+static enum aml_fs_event aml__fs_events_from_inotify(uint32_t mask)
+{
+	enum aml_fs_event events = AML_FS_EVENT_NONE;
+
+	if (mask & (IN_MODIFY | IN_CLOSE_WRITE))
+		events |= AML_FS_EVENT_MODIFY;
+	if (mask & IN_ATTRIB)
+		events |= AML_FS_EVENT_ATTRIB;
+	if (mask & (IN_CREATE | IN_MOVED_TO))
+		events |= AML_FS_EVENT_CREATE;
+	if (mask & (IN_DELETE | IN_MOVED_FROM))
+		events |= AML_FS_EVENT_DELETE;
+	if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+		events |= AML_FS_EVENT_DELETE_SELF;
+
+	return events;
+}
+
+static void aml__fs_watch_notify(struct aml* self, struct aml_fs_watch* watch,
+		enum aml_fs_event events)
+{
+	events &= watch->mask;
+	if (!events)
+		return;
+
+	/* Only the first event since the last callback is emitted */
+	if (atomic_fetch_or(&watch->pending, events) == 0)
+		aml_emit(self, watch, 0);
+}
+
+/* Called with fs_watch_mutex held */
+static void aml__handle_inotify_event(struct aml* self,
+		const struct inotify_event* event)
+{
+	if (event->mask & IN_Q_OVERFLOW) {
+		/* Events were lost, so anything might have changed */
+		for (uint32_t i = 0; i < self->fs_watches.cap; ++i)
+			for (struct aml_fs_watch* watch =
+					self->fs_watches.slots[i];
+					watch; watch = watch->next)
+				aml__fs_watch_notify(self, watch,
+						AML_FS_EVENT_MODIFY);
+		return;
+	}
+
+	struct aml_fs_watch* head =
+		aml__fs_watch_map_find(&self->fs_watches, event->wd);
+
+	enum aml_fs_event events = aml__fs_events_from_inotify(event->mask);
+	for (struct aml_fs_watch* watch = head; watch; watch = watch->next)
+		aml__fs_watch_notify(self, watch, events);
+
+	if (head && (event->mask & IN_IGNORED)) {
+		/* The kernel has removed the watch */
+		aml__fs_watch_map_remove(&self->fs_watches, event->wd);
+		for (struct aml_fs_watch* watch = head; watch;
+				watch = watch->next)
+			watch->wd = -1;
+	}
+}
+
+static void aml__on_inotify(void* obj)
+{
+	struct aml* self = aml_get_userdata(obj);
+	int fd = aml_get_fd(obj);
+
+	/* Large reads keep the number of syscalls down when many files
+	 * change at once.
+	 */
+	char buffer[16384]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	aml__lock(self, &self->fs_watch_mutex);
+
+	while (1) {
+		ssize_t len = read(fd, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+
+		for (char* ptr = buffer; ptr < buffer + len; ) {
+			const struct inotify_event* event = (void*)ptr;
+			aml__handle_inotify_event(self, event);
+			ptr += sizeof(*event) + event->len;
+		}
+	}
+
+	aml__unlock(self, &self->fs_watch_mutex);
+}
+
+/* Called with fs_watch_mutex held */
+static int aml__get_inotify_fd(struct aml* self)
+{
+	if (self->inotify_handler)
+		return aml_get_fd(self->inotify_handler);
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct aml_handler* handler =
+		aml_handler_new(fd, aml__on_inotify, self, NULL);
+	if (!handler) {
+		close(fd);
+		return -1;
+	}
+
+	handler->owns_fd = true;
+
+	if (aml_start(self, handler) < 0) {
+		aml_unref(handler);
+		return -1;
+	}
+
+	self->inotify_handler = handler;
+	return fd;
+}
+
+static int aml__start_fs_watch(struct aml* self, struct aml_fs_watch* watch)
+{
+	if (aml__is_replaying(self))
+		return 0;
+
+	aml__lock(self, &self->fs_watch_mutex);
+
+	int fd = aml__get_inotify_fd(self);
+	if (fd < 0)
+		goto failure;
+
+	int wd = inotify_add_watch(fd, watch->path, AML__INOTIFY_MASK);
+	if (wd < 0)
+		goto failure;
+
+	struct aml_fs_watch* head =
+		aml__fs_watch_map_find(&self->fs_watches, wd);
+
+	watch->wd = wd;
+	watch->next = head;
+	atomic_store(&watch->pending, 0);
+
+	if (aml__fs_watch_map_set(&self->fs_watches, watch) < 0) {
+		if (!head)
+			inotify_rm_watch(fd, wd);
+		watch->wd = -1;
+		watch->next = NULL;
+		goto failure;
+	}
+
+	aml__unlock(self, &self->fs_watch_mutex);
+	return 0;
+
+failure:
+	aml__unlock(self, &self->fs_watch_mutex);
+	return -1;
+}
+
+static int aml__stop_fs_watch(struct aml* self, struct aml_fs_watch* watch)
+{
+	aml__lock(self, &self->fs_watch_mutex);
+
+	int wd = watch->wd;
+	struct aml_fs_watch* head = wd >= 0 ?
+		aml__fs_watch_map_find(&self->fs_watches, wd) : NULL;
+
+	struct aml_fs_watch** link = &head;
+	while (*link && *link != watch)
+		link = &(*link)->next;
+
+	if (*link) {
+		*link = watch->next;
+
+		if (head) {
+			aml__fs_watch_map_set(&self->fs_watches, head);
+		} else {
+			aml__fs_watch_map_remove(&self->fs_watches, wd);
+			inotify_rm_watch(aml_get_fd(self->inotify_handler),
+					wd);
+		}
+	}
+
+	watch->wd = -1;
+	watch->next = NULL;
+
+	aml__unlock(self, &self->fs_watch_mutex);
+	return 0;
+}
+#else
+static int aml__start_fs_watch(struct aml* self, struct aml_fs_watch* watch)
+{
+	if (aml__is_replaying(self))
+		return 0;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+static int aml__stop_fs_watch(struct aml* self, struct aml_fs_watch* watch)
+{
+	return 0;
+}
+#endif
+
+static int aml__start_unchecked(struct aml* self, void* obj)
+{
+	struct aml_obj* head = obj;
+
+	switch (head->type) {
+	case AML_OBJ_AML: return -1;
+	case AML_OBJ_HANDLER: return aml__start_handler(self, obj);
+	case AML_OBJ_TIMER: /* fallthrough */
+	case AML_OBJ_TICKER: return aml__start_timer(self, obj);
+	case AML_OBJ_SIGNAL: return aml__start_signal(self, obj);
+	case AML_OBJ_WORK: return aml__start_work(self, obj);
+	case AML_OBJ_IDLE: return aml__start_idle(self, obj);
+	case AML_OBJ_CHILD: return aml__start_child(self, obj);
+	case AML_OBJ_FS_WATCH: return aml__start_fs_watch(self, obj);
+	case AML_OBJ_UNSPEC: break;
+	}
+
+	abort();
+	return -1;
+}
+
+EXPORT
+int aml_start(struct aml* self, void* obj)
+{
+	if (aml__obj_try_add(self, obj) < 0)
+		return -1;
+
+	if (aml__start_unchecked(self, obj) == 0)
+		return 0;
+
+	aml__obj_remove(self, obj);
+	return -1;
+}
+
+static int aml__stop_handler(struct aml* self, struct aml_handler* handler)
+{
+	if (!aml__is_replaying(self) && aml__del_fd(self, handler) < 0)
+		return -1;
+
+	handler->parent = NULL;
+	handler->masked = false;
+	handler->paused_revents = 0;
+
+	return 0;
+}
+
+static int aml__stop_timer(struct aml* self, struct aml_timer* timer)
+{
+	aml__lock(self, &self->timer_list_mutex);
+	LIST_REMOVE(timer, link);
+	aml__unlock(self, &self->timer_list_mutex);
+	return 0;
+}
+
+static int aml__stop_signal(struct aml* self, struct aml_signal* sig)
+{
+	if (aml__is_replaying(self))
+		return 0;
+
+	return self->backend.del_signal(self->state, sig);
+}
+
+static int aml__stop_work(struct aml* self, struct aml_work* work)
+{
+	work->deferred = false;
+	return 0;
+}
+
+static int aml__stop_idle(struct aml* self, struct aml_idle* idle)
+{
+	LIST_REMOVE(idle, link);
+	return 0;
+}
+
+static int aml__stop_child(struct aml* self, struct aml_child* child)
+{
+	if (child->pidfd_handler) {
+		aml_stop(self, child->pidfd_handler);
+		aml_unref(child->pidfd_handler);
+		child->pidfd_handler = NULL;
+		return 0;
+	}
+
+	aml__lock(self, &self->child_list_mutex);
+	if (child->link.le_prev) {
+		LIST_REMOVE(child, link);
+		child->link.le_prev = NULL;
+	}
+	aml__unlock(self, &self->child_list_mutex);
+
+	return 0;
+}
+
+static int aml__stop_unchecked(struct aml* self, void* obj)
+{
+	struct aml_obj* head = obj;
+
+	switch (head->type) {
+	case AML_OBJ_AML: return -1;
+	case AML_OBJ_HANDLER: return aml__stop_handler(self, obj);
+	case AML_OBJ_TIMER: /* fallthrough */
 	case AML_OBJ_TICKER: return aml__stop_timer(self, obj);
 	case AML_OBJ_SIGNAL: return aml__stop_signal(self, obj);
 	case AML_OBJ_WORK: return aml__stop_work(self, obj);
 	case AML_OBJ_IDLE: return aml__stop_idle(self, obj);
+	case AML_OBJ_CHILD: return aml__stop_child(self, obj);
+	case AML_OBJ_FS_WATCH: return aml__stop_fs_watch(self, obj);
 	case AML_OBJ_UNSPEC: break;
 	}
 
@@ -733,6 +1580,202 @@ int aml_stop(struct aml* self, void* obj)
 	return 0;
 }
 
+static bool aml__obj_is_timer(const void* ptr)
+{
+	const struct aml_obj* obj = ptr;
+	return obj->type == AML_OBJ_TIMER || obj->type == AML_OBJ_TICKER;
+}
+
+static bool aml__obj_is_handler(const void* ptr)
+{
+	const struct aml_obj* obj = ptr;
+	return obj->type == AML_OBJ_HANDLER;
+}
+
+/* Hand all the handlers in a set to the backend in one go. Either all of them
+ * are added or none of them.
+ */
+static int aml__start_many_handlers(struct aml* self, void* const* objs, int n)
+{
+	struct aml_handler* handlers_on_stack[64];
+	struct aml_handler** handlers = handlers_on_stack;
+
+	if (n > 64) {
+		handlers = malloc(n * sizeof(*handlers));
+		if (!handlers)
+			return -1;
+	}
+
+	int n_handlers = 0;
+	for (int i = 0; i < n; ++i)
+		if (aml__obj_is_handler(objs[i]))
+			handlers[n_handlers++] = objs[i];
+
+	int rc = 0;
+	if (n_handlers > 0)
+		rc = self->backend.add_fds(self->state, handlers, n_handlers);
+
+	if (rc == 0)
+		for (int i = 0; i < n_handlers; ++i)
+			handlers[i]->parent = self;
+
+	if (handlers != handlers_on_stack)
+		free(handlers);
+
+	return rc;
+}
+
+static void aml__start_many_timers(struct aml* self, void* const* objs, int n)
+{
+	uint64_t now = aml__gettime_us(self);
+	bool have_timers = false;
+
+	aml__lock(self, &self->timer_list_mutex);
+	for (int i = 0; i < n; ++i)
+		if (aml__obj_is_timer(objs[i])) {
+			aml__timer_insert_unlocked(self, objs[i], now);
+			have_timers = true;
+		}
+	aml__unlock(self, &self->timer_list_mutex);
+
+	if (!have_timers)
+		return;
+
+	bool interrupt = false;
+	for (int i = 0; i < n; ++i)
+		if (aml__obj_is_timer(objs[i]))
+			interrupt |= aml__timer_emit_if_expired(self, objs[i]);
+
+	/* The deadline only needs to be set if one of the new timers is the
+	 * earliest one, and then only once.
+	 */
+	struct aml_timer* earliest = aml__get_timer_with_earliest_deadline(self);
+	for (int i = 0; earliest && i < n; ++i)
+		if (objs[i] == earliest) {
+			aml__set_deadline(self, earliest->deadline);
+			break;
+		}
+
+	if (interrupt)
+		aml_interrupt(self);
+}
+
+static void aml__stop_many_timers(struct aml* self, void* const* objs,
+		const bool* stopped, int n)
+{
+	aml__lock(self, &self->timer_list_mutex);
+	for (int i = 0; i < n; ++i)
+		if (stopped[i] && aml__obj_is_timer(objs[i]))
+			LIST_REMOVE((struct aml_timer*)objs[i], link);
+	aml__unlock(self, &self->timer_list_mutex);
+}
+
+EXPORT
+int aml_start_many(struct aml* self, void* const* objs, int n)
+{
+	aml__lock(self, &self->obj_list_mutex);
+
+	int n_added = 0;
+	for (; n_added < n; ++n_added) {
+		if (aml__obj_is_started_unlocked(self, objs[n_added]))
+			break;
+
+		aml__obj_add_unlocked(self, objs[n_added]);
+	}
+
+	if (n_added < n) {
+		for (int i = 0; i < n_added; ++i)
+			aml__obj_remove_unlocked(self, objs[i]);
+
+		aml__unlock(self, &self->obj_list_mutex);
+		return -1;
+	}
+
+	aml__unlock(self, &self->obj_list_mutex);
+
+	/* Timers are started last, and handlers are started first if the
+	 * backend can take them all at once.
+	 */
+	bool batch_handlers = self->backend.add_fds && !aml__is_replaying(self);
+	if (batch_handlers && aml__start_many_handlers(self, objs, n) < 0)
+		goto handlers_failure;
+
+	int n_started = 0;
+	for (; n_started < n; ++n_started) {
+		void* obj = objs[n_started];
+		if (aml__obj_is_timer(obj) ||
+				(batch_handlers && aml__obj_is_handler(obj)))
+			continue;
+
+		if (aml__start_unchecked(self, obj) < 0)
+			goto failure;
+	}
+
+	aml__start_many_timers(self, objs, n);
+
+	return 0;
+
+failure:
+	for (int i = 0; i < n_started; ++i)
+		if (!aml__obj_is_timer(objs[i]) &&
+				!(batch_handlers && aml__obj_is_handler(objs[i])))
+			aml__stop_unchecked(self, objs[i]);
+
+	if (batch_handlers)
+		for (int i = 0; i < n; ++i)
+			if (aml__obj_is_handler(objs[i]))
+				aml__stop_unchecked(self, objs[i]);
+
+handlers_failure:
+	aml__lock(self, &self->obj_list_mutex);
+	for (int i = 0; i < n; ++i)
+		aml__obj_remove_unlocked(self, objs[i]);
+	aml__unlock(self, &self->obj_list_mutex);
+
+	return -1;
+}
+
+EXPORT
+int aml_stop_many(struct aml* self, void* const* objs, int n)
+{
+	bool stopped_on_stack[64];
+	bool* stopped = stopped_on_stack;
+
+	if (n > 64) {
+		stopped = malloc(n * sizeof(*stopped));
+		if (!stopped) {
+			for (int i = 0; i < n; ++i)
+				aml_stop(self, objs[i]);
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < n; ++i)
+		aml_ref(objs[i]);
+
+	aml__lock(self, &self->obj_list_mutex);
+	for (int i = 0; i < n; ++i) {
+		stopped[i] = aml__obj_is_started_unlocked(self, objs[i]);
+		if (stopped[i])
+			aml__obj_remove_unlocked(self, objs[i]);
+	}
+	aml__unlock(self, &self->obj_list_mutex);
+
+	aml__stop_many_timers(self, objs, stopped, n);
+
+	for (int i = 0; i < n; ++i)
+		if (stopped[i] && !aml__obj_is_timer(objs[i]))
+			aml__stop_unchecked(self, objs[i]);
+
+	for (int i = 0; i < n; ++i)
+		aml_unref(objs[i]);
+
+	if (stopped != stopped_on_stack)
+		free(stopped);
+
+	return 0;
+}
+
 static struct aml_timer* aml__get_timer_with_earliest_deadline(struct aml* self)
 {
 	uint64_t deadline = UINT64_MAX;
@@ -740,13 +1783,13 @@ static struct aml_timer* aml__get_timer_with_earliest_deadline(struct aml* self)
 
 	struct aml_timer* timer;
 
-	pthread_mutex_lock(&self->timer_list_mutex);
+	aml__lock(self, &self->timer_list_mutex);
 	LIST_FOREACH(timer, &self->timer_list, link)
 		if (!timer->expired && timer->deadline < deadline) {
 			deadline = timer->deadline;
 			result = timer;
 		}
-	pthread_mutex_unlock(&self->timer_list_mutex);
+	aml__unlock(self, &self->timer_list_mutex);
 
 	return result;
 }
@@ -784,22 +1827,151 @@ static void aml__handle_idle(struct aml* self)
 			idle->obj.cb(idle);
 }
 
-static void aml__handle_event(struct aml* self, struct aml_obj* obj)
+#define AML_RECORD_MAGIC "AMLR"
+#define AML_RECORD_VERSION 2
+#define AML_RECORD_BYTE_ORDER UINT32_C(0x01020304)
+
+enum {
+	AML_RECORD_NEW_ITERATION = 1 << 0,
+};
+
+/* The log starts with this header, followed by one record per dispatched
+ * event. All fields are in the byte order of the host that made the
+ * recording, which is given away by byte_order.
+ */
+struct aml__record_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t record_size;
+	uint64_t start_time;
+};
+
+struct aml__record {
+	uint64_t time;
+	uint64_t id;
+	uint16_t type;
+	uint16_t flags;
+	uint32_t revents;
+};
+
+/* State of a replay that is in progress */
+struct aml__replay {
+	FILE* file;
+	struct aml__record next;
+	bool have_next;
+};
+
+static void aml__record_event(struct aml* self, struct aml_obj* obj,
+		uint64_t now)
+{
+	struct aml__record record = {
+		.time = now,
+		.id = obj->id,
+		.type = obj->type,
+		.flags = self->record_new_iteration ?
+			AML_RECORD_NEW_ITERATION : 0,
+		.revents = obj->type == AML_OBJ_HANDLER ?
+			((struct aml_handler*)obj)->revents : 0,
+	};
+
+	self->record_new_iteration = false;
+
+	/* A log with holes in it would replay wrongly, so it ends here */
+	if (fwrite(&record, sizeof(record), 1, self->record_file) != 1) {
+		self->record_error = errno;
+		fclose(self->record_file);
+		self->record_file = NULL;
+	}
+}
+
+static void aml__signal_begin_delivery(struct aml_signal* sig)
+{
+	pthread_mutex_lock(&sig->info_mutex);
+	/* Replayed signals and signals that were emitted without going
+	 * through aml_signal_queue_info() count as one delivery.
+	 */
+	sig->count = sig->pending_count ? sig->pending_count : 1;
+	sig->pending_count = 0;
+	sig->info_end = sig->info_tail;
+	pthread_mutex_unlock(&sig->info_mutex);
+}
+
+static void aml__signal_end_delivery(struct aml_signal* sig)
+{
+	pthread_mutex_lock(&sig->info_mutex);
+	sig->count = 0;
+	sig->info_head = sig->info_end;
+	pthread_mutex_unlock(&sig->info_mutex);
+}
+
+/* Returns: true if the event should be held back until the handler is
+ * resumed.
+ */
+static bool aml__handler_hold_if_paused(struct aml* self,
+		struct aml_handler* handler)
+{
+	if (!handler->paused)
+		return false;
+
+	handler->paused_revents |= handler->revents;
+
+	/* Edge triggered backends are re-armed after every event anyway */
+	if (!handler->masked) {
+		handler->masked = true;
+		if (!aml__is_replaying(self) &&
+				!(self->backend.flags & AML_BACKEND_EDGE_TRIGGERED))
+			aml__mod_fd(self, handler);
+	}
+
+	return true;
+}
+
+static void aml__handle_event(struct aml* self, struct aml_obj* obj,
+		uint64_t now)
 {
 	/* A reference is kept here in case an object is stopped inside the
 	 * callback. We want the object to live until we're done with it.
 	 */
 	aml_ref(obj);
 
-	if (aml_is_started(self, obj)) {
+	bool deliver = aml_is_started(self, obj);
+	if (deliver && obj->type == AML_OBJ_HANDLER)
+		deliver = !aml__handler_hold_if_paused(self,
+				(struct aml_handler*)obj);
+
+	if (deliver) {
 		/* Single-shot objects must be stopped before the callback so
 		 * that they can be restarted from within the callback.
 		 */
 		if (aml__obj_is_single_shot(obj))
 			aml_stop(self, obj);
 
+		if (self->record_file)
+			aml__record_event(self, obj, now);
+
+		/* The work function is run here so that the done callback sees
+		 * the same state as it did when the log was recorded.
+		 */
+		if (aml__is_replaying(self) && obj->type == AML_OBJ_WORK) {
+			struct aml_work* work = (struct aml_work*)obj;
+			if (work->work_fn)
+				work->work_fn(work);
+		}
+
+		if (obj->type == AML_OBJ_SIGNAL)
+			aml__signal_begin_delivery((struct aml_signal*)obj);
+
+		if (obj->type == AML_OBJ_FS_WATCH) {
+			struct aml_fs_watch* watch = (struct aml_fs_watch*)obj;
+			watch->events = atomic_exchange(&watch->pending, 0);
+		}
+
 		if (obj->cb)
 			obj->cb(obj);
+
+		if (obj->type == AML_OBJ_SIGNAL)
+			aml__signal_end_delivery((struct aml_signal*)obj);
 	}
 
 	if (obj->type == AML_OBJ_HANDLER) {
@@ -819,45 +1991,269 @@ int aml_poll(struct aml* self, int64_t timeout_us)
 {
 	int timeout_ms = (timeout_us == INT64_C(-1))
 		? -1 : timeout_us / INT64_C(1000);
-	return aml__poll(self, timeout_ms);
+
+	aml__perf_start(self);
+	int rc = aml__poll(self, timeout_ms);
+	aml__perf_mark(self, AML_PHASE_POLL);
+
+	return rc;
+}
+
+static int aml__push_direct_event(struct aml* self, struct aml_obj* obj)
+{
+	if (self->n_direct_events == self->direct_events_cap) {
+		size_t cap = self->direct_events_cap * 2;
+		struct aml_obj** events = realloc(self->direct_events,
+				cap * sizeof(*events));
+		if (!events)
+			return -1;
+
+		self->direct_events = events;
+		self->direct_events_cap = cap;
+	}
+
+	aml_ref(obj);
+	self->direct_events[self->n_direct_events++] = obj;
+	return 0;
+}
+
+static void aml__dispatch_direct_events(struct aml* self, uint64_t now)
+{
+	/* A callback may run a nested dispatch of the same loop, so the
+	 * position is kept in the loop rather than here.
+	 */
+	while (self->direct_events_head < self->n_direct_events) {
+		struct aml_obj* obj =
+			self->direct_events[self->direct_events_head++];
+		aml__handle_event(self, obj, now);
+		aml_unref(obj);
+	}
+
+	self->direct_events_head = 0;
+	self->n_direct_events = 0;
+}
+
+static void aml__event_enqueue_unlocked(struct aml* self,
+		struct aml_obj* obj, uint32_t n)
+{
+	if (obj->n_events == 0)
+		TAILQ_INSERT_TAIL(&self->event_queue, obj, event_link);
+	obj->n_events += n;
+}
+
+static void aml__push_remote_event(struct aml* self, struct aml_obj* obj)
+{
+	aml_ref(obj);
+
+	if (atomic_fetch_add(&obj->n_remote_events, 1) != 0)
+		return;
+
+	struct aml_obj* head = atomic_load(&self->remote_events);
+	do
+		obj->remote_next = head;
+	while (!atomic_compare_exchange_weak(&self->remote_events, &head, obj));
+}
+
+static struct aml_obj* aml__take_remote_event_stack(struct aml* self)
+{
+	struct aml_obj* obj = atomic_exchange(&self->remote_events, NULL);
+
+	/* Objects are pushed onto the front, so the order is reversed to keep
+	 * them in the order in which they were emitted.
+	 */
+	struct aml_obj* list = NULL;
+	while (obj) {
+		struct aml_obj* next = obj->remote_next;
+		obj->remote_next = list;
+		list = obj;
+		obj = next;
+	}
+
+	return list;
+}
+
+/* Move events that other threads have emitted to a single threaded loop onto
+ * its own queue.
+ */
+static void aml__take_remote_events(struct aml* self)
+{
+	if (!atomic_load(&self->remote_events))
+		return;
+
+	struct aml_obj* obj = aml__take_remote_event_stack(self);
+	while (obj) {
+		/* Once the count is cleared, another thread may push the
+		 * object again, overwriting remote_next.
+		 */
+		struct aml_obj* next = obj->remote_next;
+		uint32_t n = atomic_exchange(&obj->n_remote_events, 0);
+		aml__event_enqueue_unlocked(self, obj, n);
+		obj = next;
+	}
+}
+
+static int aml__post_command(struct aml* self, enum aml__command_type type,
+		void* obj, enum aml_event mask)
+{
+	struct aml__command* command = calloc(1, sizeof(*command));
+	if (!command)
+		return -1;
+
+	command->type = type;
+	command->obj = obj;
+	command->mask = mask;
+	aml_ref(obj);
+
+	struct aml__command* head = atomic_load(&self->commands);
+	do
+		command->next = head;
+	while (!atomic_compare_exchange_weak(&self->commands, &head, command));
+
+	aml_interrupt(self);
+	return 0;
+}
+
+EXPORT
+int aml_post_start(struct aml* self, void* obj)
+{
+	return aml__post_command(self, AML__COMMAND_START, obj, 0);
+}
+
+EXPORT
+int aml_post_stop(struct aml* self, void* obj)
+{
+	return aml__post_command(self, AML__COMMAND_STOP, obj, 0);
+}
+
+EXPORT
+int aml_post_set_event_mask(struct aml* self, struct aml_handler* handler,
+		enum aml_event mask)
+{
+	return aml__post_command(self, AML__COMMAND_SET_EVENT_MASK, handler,
+			mask);
+}
+
+int aml_start_from_any_thread(struct aml* self, void* obj)
+{
+	if (aml__is_single_threaded(self) && !aml__is_owner(self))
+		return aml_post_start(self, obj);
+
+	return aml_start(self, obj);
+}
+
+static struct aml__command* aml__take_commands(struct aml* self)
+{
+	struct aml__command* command = atomic_exchange(&self->commands, NULL);
+
+	struct aml__command* list = NULL;
+	while (command) {
+		struct aml__command* next = command->next;
+		command->next = list;
+		list = command;
+		command = next;
+	}
+
+	return list;
+}
+
+static void aml__apply_commands(struct aml* self)
+{
+	if (!atomic_load(&self->commands))
+		return;
+
+	struct aml__command* command = aml__take_commands(self);
+	while (command) {
+		struct aml__command* next = command->next;
+
+		switch (command->type) {
+		case AML__COMMAND_START:
+			aml_start(self, command->obj);
+			break;
+		case AML__COMMAND_STOP:
+			aml_stop(self, command->obj);
+			break;
+		case AML__COMMAND_SET_EVENT_MASK:
+			aml_set_event_mask((struct aml_handler*)command->obj,
+					command->mask);
+			break;
+		}
+
+		aml_unref(command->obj);
+		free(command);
+		command = next;
+	}
 }
 
 static struct aml_obj* aml__event_dequeue(struct aml* self)
 {
-	pthread_mutex_lock(&self->event_queue_mutex);
+	if (aml__is_single_threaded(self) &&
+			TAILQ_EMPTY(&self->event_queue))
+		aml__take_remote_events(self);
+
+	aml__lock(self, &self->event_queue_mutex);
 	struct aml_obj* obj = TAILQ_FIRST(&self->event_queue);
 	if (obj && --obj->n_events == 0)
 		TAILQ_REMOVE(&self->event_queue, obj, event_link);
-	pthread_mutex_unlock(&self->event_queue_mutex);
+	aml__unlock(self, &self->event_queue_mutex);
 	return obj;
 }
 
 EXPORT
 void aml_dispatch(struct aml* self)
 {
+	aml__perf_start(self);
+
+	aml__apply_commands(self);
+
 	uint64_t now = aml__gettime_us(self);
-	while (aml__handle_timeout(self, now));
 
-	struct aml_timer* earliest = aml__get_timer_with_earliest_deadline(self);
-	if (earliest) {
-		assert(earliest->deadline > now);
-		aml__set_deadline(self, earliest->deadline);
+	if (!aml__is_replaying(self)) {
+		while (aml__handle_timeout(self, now));
+
+		struct aml_timer* earliest =
+			aml__get_timer_with_earliest_deadline(self);
+		if (earliest) {
+			assert(earliest->deadline > now);
+			aml__set_deadline(self, earliest->deadline);
+		}
 	}
 
+	aml__perf_mark(self, AML_PHASE_TIMERS);
+
+	/* Nothing is emitted from signal handlers to a single threaded loop,
+	 * so signals don't need to be blocked.
+	 */
+	bool block_signals = !aml__is_single_threaded(self);
+
 	sigset_t sig_old, sig_new;
 	sigfillset(&sig_new);
 
-	pthread_sigmask(SIG_BLOCK, &sig_new, &sig_old);
+	if (block_signals)
+		pthread_sigmask(SIG_BLOCK, &sig_new, &sig_old);
+
+	/* Timers emitted above are queued behind fd events from the poll, so
+	 * running the direct events first keeps that order. Other queued
+	 * events, e.g. finished work or signals, now come after them even if
+	 * they were emitted first.
+	 */
+	aml__dispatch_direct_events(self, now);
 
 	struct aml_obj* obj;
 	while ((obj = aml__event_dequeue(self)) != NULL) {
-		aml__handle_event(self, obj);
+		aml__handle_event(self, obj, now);
 		aml_unref(obj);
 	}
 
-	pthread_sigmask(SIG_SETMASK, &sig_old, NULL);
+	if (block_signals)
+		pthread_sigmask(SIG_SETMASK, &sig_old, NULL);
+
+	aml__perf_mark(self, AML_PHASE_EVENTS);
+
+	self->record_new_iteration = true;
 
 	aml__handle_idle(self);
+	aml__perf_mark(self, AML_PHASE_IDLE);
+
 	aml__post_dispatch(self);
 }
 
@@ -888,16 +2284,18 @@ int aml_ref(void* obj)
 {
 	struct aml_obj* self = obj;
 
-	aml__ref_lock();
-	assert(self->ref >= 0);
-	int ref = self->ref++;
-	aml__ref_unlock();
+	int ref = atomic_fetch_add_explicit(&self->ref, 1,
+			memory_order_relaxed);
+	assert(ref >= 0);
 
 	return ref;
 }
 
 static void aml__free(struct aml* self)
 {
+	/* Whichever thread drops the last reference owns the loop now */
+	self->owner = pthread_self();
+
 	while (!LIST_EMPTY(&self->obj_list)) {
 		struct aml_obj* obj = LIST_FIRST(&self->obj_list);
 
@@ -905,17 +2303,53 @@ static void aml__free(struct aml* self)
 		aml__obj_remove_unlocked(self, obj);
 	}
 
+	if (self->sigchld)
+		aml_unref(self->sigchld);
+
+	if (self->inotify_handler)
+		aml_unref(self->inotify_handler);
+	free(self->fs_watches.slots);
+
 	if (self->have_thread_pool)
 		self->backend.thread_pool_release(self);
 
 	self->backend.del_state(self->state);
 
+	perf_group_del(self->perf);
+
+	aml_record_stop(self);
+	aml_replay_stop(self);
+
 	while (!TAILQ_EMPTY(&self->event_queue)) {
 		struct aml_obj* obj = TAILQ_FIRST(&self->event_queue);
 		TAILQ_REMOVE(&self->event_queue, obj, event_link);
 		aml_unref(obj);
 	}
 
+	for (size_t i = self->direct_events_head; i < self->n_direct_events;
+			++i)
+		aml_unref(self->direct_events[i]);
+	free(self->direct_events);
+
+	struct aml_obj* obj = aml__take_remote_event_stack(self);
+	while (obj) {
+		struct aml_obj* next = obj->remote_next;
+		uint32_t n = atomic_exchange(&obj->n_remote_events, 0);
+		while (n-- > 0)
+			aml_unref(obj);
+		obj = next;
+	}
+
+	struct aml__command* command = aml__take_commands(self);
+	while (command) {
+		struct aml__command* next = command->next;
+		aml_unref(command->obj);
+		free(command);
+		command = next;
+	}
+
+	pthread_mutex_destroy(&self->fs_watch_mutex);
+	pthread_mutex_destroy(&self->child_list_mutex);
 	pthread_mutex_destroy(&self->timer_list_mutex);
 	pthread_mutex_destroy(&self->obj_list_mutex);
 	pthread_mutex_destroy(&self->event_queue_mutex);
@@ -928,6 +2362,9 @@ static void aml__free_handler(struct aml_handler* self)
 	if (self->obj.free_fn)
 		self->obj.free_fn(self->obj.userdata);
 
+	if (self->owns_fd)
+		close(self->fd);
+
 	free(self);
 }
 
@@ -944,6 +2381,7 @@ static void aml__free_signal(struct aml_signal* self)
 	if (self->obj.free_fn)
 		self->obj.free_fn(self->obj.userdata);
 
+	pthread_mutex_destroy(&self->info_mutex);
 	free(self);
 }
 
@@ -963,15 +2401,30 @@ static void aml__free_idle(struct aml_idle* self)
 	free(self);
 }
 
+static void aml__free_child(struct aml_child* self)
+{
+	if (self->obj.free_fn)
+		self->obj.free_fn(self->obj.userdata);
+
+	free(self);
+}
+
+static void aml__free_fs_watch(struct aml_fs_watch* self)
+{
+	if (self->obj.free_fn)
+		self->obj.free_fn(self->obj.userdata);
+
+	free(self->path);
+	free(self);
+}
+
 EXPORT
 int aml_unref(void* obj)
 {
 	struct aml_obj* self = obj;
 
-	aml__ref_lock();
-	int ref = --self->ref;
-	aml__ref_unlock();
-
+	int ref = atomic_fetch_sub_explicit(&self->ref, 1,
+			memory_order_acq_rel) - 1;
 	assert(ref >= 0);
 	if (ref > 0)
 		goto done;
@@ -1005,6 +2458,12 @@ int aml_unref(void* obj)
 	case AML_OBJ_IDLE:
 		aml__free_idle(obj);
 		break;
+	case AML_OBJ_CHILD:
+		aml__free_child(obj);
+		break;
+	case AML_OBJ_FS_WATCH:
+		aml__free_fs_watch(obj);
+		break;
 	default:
 		abort();
 		break;
@@ -1038,6 +2497,23 @@ void aml_emit(struct aml* self, void* ptr, uint32_t revents)
 		uint32_t old = atomic_fetch_or(&handler->revents, revents);
 		if (old != 0)
 			return;
+
+		/* Events that the backend finds while the loop is polling on
+		 * its own thread skip the queue and its lock.
+		 */
+		if (aml__polling == self &&
+				aml__push_direct_event(self, obj) == 0)
+			return;
+	}
+
+	if (aml__is_single_threaded(self)) {
+		if (aml__is_owner(self)) {
+			aml__event_enqueue_unlocked(self, obj, 1);
+			aml_ref(obj);
+		} else {
+			aml__push_remote_event(self, obj);
+		}
+		return;
 	}
 
 	sigset_t sig_old, sig_new;
@@ -1045,8 +2521,7 @@ void aml_emit(struct aml* self, void* ptr, uint32_t revents)
 
 	pthread_sigmask(SIG_BLOCK, &sig_new, &sig_old);
 	pthread_mutex_lock(&self->event_queue_mutex);
-	if (obj->n_events++ == 0)
-		TAILQ_INSERT_TAIL(&self->event_queue, obj, event_link);
+	aml__event_enqueue_unlocked(self, obj, 1);
 	aml_ref(obj);
 	pthread_mutex_unlock(&self->event_queue_mutex);
 	pthread_sigmask(SIG_SETMASK, &sig_old, NULL);
@@ -1063,10 +2538,58 @@ void aml_set_event_mask(struct aml_handler* handler, enum aml_event mask)
 {
 	handler->event_mask = mask;
 
+	if (handler->masked)
+		return;
+
 	if (handler->parent && aml_is_started(handler->parent, handler))
 		aml__mod_fd(handler->parent, handler);
 }
 
+enum aml_event aml_get_active_event_mask(const struct aml_handler* handler)
+{
+	return handler->masked ? AML_EVENT_NONE : handler->event_mask;
+}
+
+EXPORT
+void aml_pause(struct aml_handler* handler)
+{
+	handler->paused = true;
+}
+
+EXPORT
+void aml_resume(struct aml_handler* handler)
+{
+	if (!handler->paused)
+		return;
+
+	handler->paused = false;
+
+	struct aml* parent = handler->parent;
+	if (!parent || !aml_is_started(parent, handler))
+		return;
+
+	uint32_t revents = handler->paused_revents;
+	handler->paused_revents = 0;
+
+	if (handler->masked) {
+		handler->masked = false;
+		if (!aml__is_replaying(parent))
+			aml__mod_fd(parent, handler);
+	}
+
+	/* A level triggered backend reports the fd again if it's still
+	 * ready, but an edge triggered one won't.
+	 */
+	if (revents && (parent->backend.flags & AML_BACKEND_EDGE_TRIGGERED))
+		aml_emit(parent, handler, revents);
+}
+
+EXPORT
+bool aml_is_paused(const struct aml_handler* handler)
+{
+	return handler->paused;
+}
+
 EXPORT
 enum aml_event aml_get_revents(const struct aml_handler* handler)
 {
@@ -1098,6 +2621,68 @@ int aml_get_signo(const struct aml_signal* sig)
 	return sig->signo;
 }
 
+EXPORT
+unsigned int aml_get_signal_count(const struct aml_signal* sig)
+{
+	return sig->count;
+}
+
+EXPORT
+int aml_signal_read_info(struct aml_signal* sig, struct aml_siginfo* out,
+                         int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&sig->info_mutex);
+	while (n < max && sig->info_head != sig->info_end) {
+		out[n++] = sig->info[sig->info_head % AML_SIGINFO_QUEUE_SIZE];
+		sig->info_head++;
+	}
+	pthread_mutex_unlock(&sig->info_mutex);
+
+	return n;
+}
+
+void aml_signal_queue_info(struct aml_signal* sig,
+                           const struct aml_siginfo* info, unsigned int count)
+{
+	pthread_mutex_lock(&sig->info_mutex);
+
+	sig->pending_count += count;
+
+	/* Records that don't fit are dropped, but they are still counted */
+	if (info && sig->info_tail - sig->info_head < AML_SIGINFO_QUEUE_SIZE) {
+		sig->info[sig->info_tail % AML_SIGINFO_QUEUE_SIZE] = *info;
+		sig->info_tail++;
+	}
+
+	pthread_mutex_unlock(&sig->info_mutex);
+}
+
+EXPORT
+pid_t aml_get_pid(const struct aml_child* child)
+{
+	return child->pid;
+}
+
+EXPORT
+int aml_get_exit_status(const struct aml_child* child)
+{
+	return child->status;
+}
+
+EXPORT
+const char* aml_get_fs_path(const struct aml_fs_watch* watch)
+{
+	return watch->path;
+}
+
+EXPORT
+enum aml_fs_event aml_get_fs_events(const struct aml_fs_watch* watch)
+{
+	return watch->events;
+}
+
 aml_callback_fn aml_get_work_fn(const struct aml_work* work)
 {
 	return work->work_fn;
@@ -1136,3 +2721,405 @@ void aml_set_duration(void* ptr, uint64_t duration)
 
 	abort();
 }
+
+EXPORT
+int aml_enable_perf_counters(struct aml* self, bool enable)
+{
+	if (!enable) {
+		perf_group_del(self->perf);
+		self->perf = NULL;
+		return 0;
+	}
+
+	if (self->perf)
+		return 0;
+
+	self->perf = perf_group_new();
+	if (!self->perf)
+		return -1;
+
+	for (int i = 0; i < PERF_COUNTER_MAX; ++i)
+		self->perf_available[i] = perf_group_has_counter(self->perf, i);
+
+	return 0;
+}
+
+EXPORT
+void aml_get_perf_counters(const struct aml* self, enum aml_phase phase,
+                           struct aml_perf_counters* out)
+{
+	assert(phase < AML_PHASE_MAX);
+	*out = self->perf_counters[phase];
+
+	const bool* available = self->perf_available;
+	if (!available[PERF_COUNTER_CYCLES])
+		out->cycles = AML_PERF_UNAVAILABLE;
+	if (!available[PERF_COUNTER_INSTRUCTIONS])
+		out->instructions = AML_PERF_UNAVAILABLE;
+	if (!available[PERF_COUNTER_CACHE_MISSES])
+		out->cache_misses = AML_PERF_UNAVAILABLE;
+	if (!available[PERF_COUNTER_BRANCH_MISSES])
+		out->branch_misses = AML_PERF_UNAVAILABLE;
+	if (!available[PERF_COUNTER_CONTEXT_SWITCHES])
+		out->context_switches = AML_PERF_UNAVAILABLE;
+}
+
+EXPORT
+void aml_reset_perf_counters(struct aml* self)
+{
+	memset(self->perf_counters, 0, sizeof(self->perf_counters));
+}
+
+/* Armed timers keep the time they have left when the clock is replaced */
+static void aml__rebase_timers(struct aml* self, uint64_t delta)
+{
+	struct aml_timer* timer;
+
+	aml__lock(self, &self->timer_list_mutex);
+	LIST_FOREACH(timer, &self->timer_list, link)
+		timer->deadline += delta;
+	aml__unlock(self, &self->timer_list_mutex);
+
+	struct aml_timer* earliest = aml__get_timer_with_earliest_deadline(self);
+	if (earliest)
+		aml__set_deadline(self, earliest->deadline);
+}
+
+EXPORT
+void aml_set_clock(struct aml* self, aml_clock_fn clock_fn, void* userdata)
+{
+	uint64_t before = aml__gettime_us(self);
+
+	self->clock_fn = clock_fn;
+	self->clock_userdata = userdata;
+
+	aml__rebase_timers(self, aml__gettime_us(self) - before);
+}
+
+static uint64_t aml__virtual_clock(void* userdata)
+{
+	struct aml* self = userdata;
+	return atomic_load(&self->virtual_time);
+}
+
+EXPORT
+void aml_use_virtual_clock(struct aml* self, uint64_t start)
+{
+	/* The virtual clock may already be in use, so the current time must
+	 * be read before it's moved.
+	 */
+	uint64_t before = aml__gettime_us(self);
+
+	atomic_store(&self->virtual_time, start);
+	self->clock_fn = aml__virtual_clock;
+	self->clock_userdata = self;
+
+	aml__rebase_timers(self, start - before);
+}
+
+EXPORT
+int aml_advance_clock(struct aml* self, uint64_t delta)
+{
+	if (self->clock_fn != aml__virtual_clock) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_fetch_add(&self->virtual_time, delta);
+	aml_interrupt(self);
+	return 0;
+}
+
+EXPORT
+uint64_t aml_get_time(struct aml* self)
+{
+	return aml__gettime_us(self);
+}
+
+EXPORT
+unsigned long long aml_get_id(const void* ptr)
+{
+	const struct aml_obj* obj = ptr;
+	return obj->id;
+}
+
+EXPORT
+void aml_set_id(void* ptr, unsigned long long id)
+{
+	struct aml_obj* obj = ptr;
+	obj->id = id;
+}
+
+EXPORT
+int aml_record_start(struct aml* self, int fd)
+{
+	if (self->record_file)
+		return -1;
+
+	int dup_fd = dup(fd);
+	if (dup_fd < 0)
+		return -1;
+
+	FILE* file = fdopen(dup_fd, "wb");
+	if (!file) {
+		close(dup_fd);
+		return -1;
+	}
+
+	struct aml__record_header header = {
+		.magic = AML_RECORD_MAGIC,
+		.version = AML_RECORD_VERSION,
+		.byte_order = AML_RECORD_BYTE_ORDER,
+		.record_size = sizeof(struct aml__record),
+		.start_time = aml__gettime_us(self),
+	};
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return -1;
+	}
+
+	self->record_file = file;
+	self->record_new_iteration = true;
+	self->record_error = 0;
+	return 0;
+}
+
+EXPORT
+int aml_record_stop(struct aml* self)
+{
+	if (self->record_file && fclose(self->record_file) != 0 &&
+			!self->record_error)
+		self->record_error = errno;
+	self->record_file = NULL;
+
+	int error = self->record_error;
+	self->record_error = 0;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns: an array holding a reference to each started object, which must be
+ * released with aml__release_started(), or NULL on failure.
+ */
+static struct aml_obj** aml__take_started(struct aml* self, size_t* n)
+{
+	struct aml_obj* obj;
+
+	aml__lock(self, &self->obj_list_mutex);
+
+	*n = 0;
+	LIST_FOREACH(obj, &self->obj_list, link)
+		++*n;
+
+	struct aml_obj** objs = malloc((*n + 1) * sizeof(*objs));
+	if (objs) {
+		size_t i = 0;
+		LIST_FOREACH(obj, &self->obj_list, link) {
+			aml_ref(obj);
+			objs[i++] = obj;
+		}
+	}
+
+	aml__unlock(self, &self->obj_list_mutex);
+	return objs;
+}
+
+static void aml__release_started(struct aml_obj** objs, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		aml_unref(objs[i]);
+	free(objs);
+}
+
+/* Hand an object that was started while replaying, or that was taken out of
+ * the backend when the replay started, to the backend or the thread pool.
+ */
+static int aml__replay_register(struct aml* self, struct aml_obj* obj)
+{
+	struct aml_work* work;
+	struct aml_child* child;
+	struct aml_fs_watch* watch;
+
+	switch (obj->type) {
+	case AML_OBJ_HANDLER:
+		return aml__add_fd(self, (struct aml_handler*)obj);
+	case AML_OBJ_SIGNAL:
+		return self->backend.add_signal(self->state,
+				(struct aml_signal*)obj);
+	case AML_OBJ_WORK:
+		work = (struct aml_work*)obj;
+		if (!work->deferred)
+			return 0;
+		work->deferred = false;
+		return aml__start_work(self, work);
+	case AML_OBJ_CHILD:
+		child = (struct aml_child*)obj;
+		if (child->pidfd_handler || child->link.le_prev)
+			return 0;
+		return aml__start_child(self, child);
+	case AML_OBJ_FS_WATCH:
+		watch = (struct aml_fs_watch*)obj;
+		if (watch->wd >= 0)
+			return 0;
+		return aml__start_fs_watch(self, watch);
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void aml__restore_real_clock(struct aml* self)
+{
+	if (self->clock_fn == aml__virtual_clock)
+		aml_set_clock(self, NULL, NULL);
+}
+
+EXPORT
+int aml_replay_start(struct aml* self, int fd)
+{
+	if (self->replay)
+		return -1;
+
+	struct aml__replay* replay = calloc(1, sizeof(*replay));
+	if (!replay)
+		return -1;
+
+	int dup_fd = dup(fd);
+	if (dup_fd < 0)
+		goto dup_failure;
+
+	replay->file = fdopen(dup_fd, "rb");
+	if (!replay->file) {
+		close(dup_fd);
+		goto dup_failure;
+	}
+
+	struct aml__record_header header;
+	if (fread(&header, sizeof(header), 1, replay->file) != 1 ||
+			memcmp(header.magic, AML_RECORD_MAGIC, 4) != 0 ||
+			header.version != AML_RECORD_VERSION ||
+			header.byte_order != AML_RECORD_BYTE_ORDER ||
+			header.record_size != sizeof(struct aml__record))
+		goto failure;
+
+	size_t n;
+	struct aml_obj** objs = aml__take_started(self, &n);
+	if (!objs)
+		goto failure;
+
+	/* Only the log may produce events from here on */
+	for (size_t i = 0; i < n; ++i)
+		if (objs[i]->type == AML_OBJ_HANDLER)
+			aml__del_fd(self, (struct aml_handler*)objs[i]);
+		else if (objs[i]->type == AML_OBJ_SIGNAL)
+			self->backend.del_signal(self->state,
+					(struct aml_signal*)objs[i]);
+
+	aml__release_started(objs, n);
+
+	self->replay = replay;
+	aml_use_virtual_clock(self, header.start_time);
+	return 0;
+
+failure:
+	fclose(replay->file);
+dup_failure:
+	free(replay);
+	return -1;
+}
+
+EXPORT
+int aml_replay_stop(struct aml* self)
+{
+	if (!self->replay)
+		return 0;
+
+	fclose(self->replay->file);
+	free(self->replay);
+	self->replay = NULL;
+
+	aml__restore_real_clock(self);
+
+	size_t n;
+	struct aml_obj** objs = aml__take_started(self, &n);
+	if (!objs)
+		return -1;
+
+	int rc = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (aml__replay_register(self, objs[i]) == 0)
+			continue;
+
+		/* It can't receive events, so it shouldn't look started */
+		aml_stop(self, objs[i]);
+		rc = -1;
+	}
+
+	aml__release_started(objs, n);
+	return rc;
+}
+
+static bool aml__replay_peek(struct aml* self, struct aml__record* record)
+{
+	struct aml__replay* replay = self->replay;
+
+	if (!replay->have_next) {
+		if (fread(&replay->next, sizeof(replay->next), 1,
+					replay->file) != 1)
+			return false;
+
+		replay->have_next = true;
+	}
+
+	*record = replay->next;
+	return true;
+}
+
+static struct aml_obj* aml__find_started_by_id(struct aml* self,
+		unsigned long long id)
+{
+	struct aml_obj* obj;
+
+	aml__lock(self, &self->obj_list_mutex);
+	LIST_FOREACH(obj, &self->obj_list, link)
+		if (obj->id == id)
+			break;
+	aml__unlock(self, &self->obj_list_mutex);
+
+	return obj;
+}
+
+EXPORT
+int aml_replay_step(struct aml* self)
+{
+	if (!self->replay)
+		return -1;
+
+	struct aml__record record;
+	if (!aml__replay_peek(self, &record))
+		return 0;
+
+	uint64_t now = aml__gettime_us(self);
+	if (record.time > now)
+		aml_advance_clock(self, record.time - now);
+
+	int n = 0;
+	do {
+		self->replay->have_next = false;
+		n++;
+
+		struct aml_obj* obj = aml__find_started_by_id(self, record.id);
+		if (obj && obj->type == record.type)
+			aml_emit(self, obj, record.revents);
+	} while (aml__replay_peek(self, &record) &&
+			!(record.flags & AML_RECORD_NEW_ITERATION));
+
+	return n;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "aml.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* The header is padded to a cache line so that the reference count doesn't
+ * share one with the payload.
+ */
+#define AML_BUF_ALIGN 64
+#define AML_BUF_HEADER_SIZE \
+	((sizeof(struct aml_buf) + AML_BUF_ALIGN - 1) & ~(AML_BUF_ALIGN - 1))
+
+struct aml_buf {
+	struct aml_buf_pool* pool;
+	atomic_uint ref;
+	struct aml_buf* next;
+};
+
+struct aml_buf_pool {
+	size_t buf_size;
+	pthread_t owner;
+
+	/* One reference is held by the creator and one by each buffer that is
+	 * in use.
+	 */
+	atomic_uint ref;
+
+	/* Only touched by the owner thread */
+	struct aml_buf* free_list;
+
+	/* Buffers released by other threads. This is only ever emptied as a
+	 * whole, so there is no ABA problem.
+	 */
+	_Atomic(struct aml_buf*) remote_free_list;
+};
+
+static void aml_buf__free_list(struct aml_buf* buf)
+{
+	while (buf) {
+		struct aml_buf* next = buf->next;
+		free(buf);
+		buf = next;
+	}
+}
+
+static void aml_buf_pool__unref(struct aml_buf_pool* self)
+{
+	if (atomic_fetch_sub(&self->ref, 1) != 1)
+		return;
+
+	aml_buf__free_list(self->free_list);
+	aml_buf__free_list(atomic_exchange(&self->remote_free_list, NULL));
+	free(self);
+}
+
+EXPORT
+struct aml_buf_pool* aml_buf_pool_new(size_t buf_size)
+{
+	struct aml_buf_pool* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->buf_size = buf_size;
+	self->owner = pthread_self();
+	atomic_init(&self->ref, 1);
+	atomic_init(&self->remote_free_list, NULL);
+
+	return self;
+}
+
+EXPORT
+void aml_buf_pool_del(struct aml_buf_pool* self)
+{
+	if (!self)
+		return;
+
+	aml_buf__free_list(self->free_list);
+	self->free_list = NULL;
+
+	aml_buf_pool__unref(self);
+}
+
+static bool aml_buf_pool__is_owner(const struct aml_buf_pool* self)
+{
+	return pthread_equal(pthread_self(), self->owner);
+}
+
+static struct aml_buf* aml_buf__alloc(struct aml_buf_pool* pool)
+{
+	size_t size = AML_BUF_HEADER_SIZE + pool->buf_size;
+	size = (size + AML_BUF_ALIGN - 1) & ~(AML_BUF_ALIGN - 1);
+
+	return aligned_alloc(AML_BUF_ALIGN, size);
+}
+
+EXPORT
+struct aml_buf* aml_buf_new(struct aml_buf_pool* pool)
+{
+	struct aml_buf* self = NULL;
+
+	if (aml_buf_pool__is_owner(pool)) {
+		if (!pool->free_list)
+			pool->free_list = atomic_exchange(
+					&pool->remote_free_list, NULL);
+
+		self = pool->free_list;
+		if (self)
+			pool->free_list = self->next;
+	}
+
+	if (!self)
+		self = aml_buf__alloc(pool);
+
+	if (!self)
+		return NULL;
+
+	self->pool = pool;
+	self->next = NULL;
+	atomic_init(&self->ref, 1);
+
+	atomic_fetch_add(&pool->ref, 1);
+	return self;
+}
+
+EXPORT
+void aml_buf_ref(struct aml_buf* self)
+{
+	atomic_fetch_add_explicit(&self->ref, 1, memory_order_relaxed);
+}
+
+static void aml_buf__release(struct aml_buf* self)
+{
+	struct aml_buf_pool* pool = self->pool;
+
+	if (aml_buf_pool__is_owner(pool)) {
+		self->next = pool->free_list;
+		pool->free_list = self;
+	} else {
+		struct aml_buf* head = atomic_load(&pool->remote_free_list);
+		do
+			self->next = head;
+		while (!atomic_compare_exchange_weak(&pool->remote_free_list,
+					&head, self));
+	}
+
+	aml_buf_pool__unref(pool);
+}
+
+EXPORT
+void aml_buf_unref(struct aml_buf* self)
+{
+	if (!self)
+		return;
+
+	unsigned int ref = atomic_fetch_sub_explicit(&self->ref, 1,
+			memory_order_acq_rel);
+	assert(ref > 0);
+
+	if (ref == 1)
+		aml_buf__release(self);
+}
+
+EXPORT
+void* aml_buf_data(struct aml_buf* self)
+{
+	return (char*)self + AML_BUF_HEADER_SIZE;
+}
+
+EXPORT
+size_t aml_buf_size(const struct aml_buf* self)
+{
+	return self->pool->buf_size;
+}
+
+EXPORT
+struct aml_slice aml_slice_new(struct aml_buf* buf, size_t offset,
+		size_t len)
+{
+	assert(offset + len <= aml_buf_size(buf));
+
+	aml_buf_ref(buf);
+
+	struct aml_slice slice = {
+		.buf = buf,
+		.offset = offset,
+		.len = len,
+	};
+	return slice;
+}
+
+EXPORT
+struct aml_slice aml_slice_dup(const struct aml_slice* self)
+{
+	return aml_slice_new(self->buf, self->offset, self->len);
+}
+
+EXPORT
+void aml_slice_release(struct aml_slice* self)
+{
+	aml_buf_unref(self->buf);
+
+	self->buf = NULL;
+	self->offset = 0;
+	self->len = 0;
+}
+
+EXPORT
+const void* aml_slice_data(const struct aml_slice* self)
+{
+	return (const char*)aml_buf_data(self->buf) + self->offset;
+}
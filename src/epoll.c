@@ -25,6 +25,7 @@
 #include <sys/timerfd.h>
 #include <sys/signalfd.h>
 #include <signal.h>
+#include <string.h>
 #include <assert.h>
 
 struct epoll_state {
@@ -32,12 +33,16 @@ struct epoll_state {
 
 	int epoll_fd;
 	int timer_fd;
-};
 
-struct epoll_signal {
-	struct epoll_state* state;
-	int fd;
-	struct aml_weak_ref* ref;
+	/* All signals watched by the loop share one signalfd, which is
+	 * created when the first signal is added.
+	 */
+	int signal_fd;
+	sigset_t signal_mask;
+	struct aml_signal** signals;
+	size_t n_signals;
+	size_t max_signals;
+	pthread_mutex_t signal_mutex;
 };
 
 static void* epoll_new_state(struct aml* aml)
@@ -47,6 +52,9 @@ static void* epoll_new_state(struct aml* aml)
 		return NULL;
 
 	self->aml = aml;
+	self->signal_fd = -1;
+	sigemptyset(&self->signal_mask);
+	pthread_mutex_init(&self->signal_mutex, NULL);
 
 	self->epoll_fd = epoll_create(16);
 	if (self->epoll_fd < 0)
@@ -69,6 +77,7 @@ timer_add_failure:
 timer_fd_failure:
 	close(self->epoll_fd);
 epoll_failure:
+	pthread_mutex_destroy(&self->signal_mutex);
 	free(self);
 	return NULL;
 }
@@ -76,8 +85,12 @@ epoll_failure:
 static void epoll_del_state(void* state)
 {
 	struct epoll_state* self = state;
+	if (self->signal_fd >= 0)
+		close(self->signal_fd);
 	close(self->timer_fd);
 	close(self->epoll_fd);
+	pthread_mutex_destroy(&self->signal_mutex);
+	free(self->signals);
 	free(self);
 }
 
@@ -87,6 +100,60 @@ static int epoll_get_fd(const void* state)
 	return self->epoll_fd;
 }
 
+static void epoll_siginfo_from_signalfd(struct aml_siginfo* dst,
+		const struct signalfd_siginfo* src)
+{
+	dst->signo = src->ssi_signo;
+	dst->code = src->ssi_code;
+	dst->pid = src->ssi_pid;
+	dst->uid = src->ssi_uid;
+	dst->status = src->ssi_status;
+	dst->value = src->ssi_ptr;
+}
+
+/* Called with signal_mutex held */
+static void epoll_queue_siginfo(struct epoll_state* self,
+		const struct signalfd_siginfo* fdsi)
+{
+	struct aml_siginfo info;
+	epoll_siginfo_from_signalfd(&info, fdsi);
+
+	for (size_t i = 0; i < self->n_signals; ++i)
+		if (aml_get_signo(self->signals[i]) == (int)fdsi->ssi_signo)
+			aml_signal_queue_info(self->signals[i], &info, 1);
+}
+
+static void epoll_on_signals(struct epoll_state* self)
+{
+	struct signalfd_siginfo info[16];
+	size_t max_info = sizeof(info) / sizeof(info[0]);
+	sigset_t pending;
+	sigemptyset(&pending);
+
+	pthread_mutex_lock(&self->signal_mutex);
+
+	ssize_t len;
+	do {
+		len = read(self->signal_fd, info, sizeof(info));
+		if (len <= 0)
+			break;
+
+		for (size_t i = 0; i < (size_t)len / sizeof(info[0]); ++i) {
+			epoll_queue_siginfo(self, &info[i]);
+			sigaddset(&pending, info[i].ssi_signo);
+		}
+	} while ((size_t)len == max_info * sizeof(info[0]));
+
+	/* Multiple deliveries of the same signal are emitted as one event.
+	 * The signal count tells how many there were.
+	 */
+	for (size_t i = 0; i < self->n_signals; ++i)
+		if (sigismember(&pending, aml_get_signo(self->signals[i])))
+			aml_emit(self->aml, self->signals[i], 0);
+
+	pthread_mutex_unlock(&self->signal_mutex);
+}
+
 static void epoll_emit_event(struct epoll_state* self,
 		struct epoll_event* event)
 {
@@ -97,6 +164,11 @@ static void epoll_emit_event(struct epoll_state* self,
 		return;
 	}
 
+	if (event->data.ptr == &self->signal_fd) {
+		epoll_on_signals(self);
+		return;
+	}
+
 	enum aml_event aml_events = AML_EVENT_NONE;
 	if (event->events & EPOLLIN)
 		aml_events |= AML_EVENT_READ;
@@ -124,7 +196,7 @@ static int epoll_poll(void* state, int timeout)
 static void epoll_event_from_aml_handler(struct epoll_event* event,
 		struct aml_handler* handler)
 {
-	enum aml_event in = aml_get_event_mask(handler);
+	enum aml_event in = aml_get_active_event_mask(handler);
 
 	event->events = 0;
 	if (in & AML_EVENT_READ)
@@ -164,85 +236,103 @@ static int epoll_del_fd(void* state, struct aml_handler* handler)
 			&event);
 }
 
-static void epoll_signal_cleanup(void* userdata)
+/* Called with signal_mutex held */
+static int epoll_update_signal_fd(struct epoll_state* self)
 {
-	struct epoll_signal* sig = userdata;
-	close(sig->fd);
-	aml_weak_ref_del(sig->ref);
-	free(sig);
-}
+	int fd = signalfd(self->signal_fd, &self->signal_mask,
+			SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
 
-static void epoll_on_signal(void* obj)
-{
-	struct aml_handler* handler = obj;
-	struct epoll_signal* ctx = aml_get_userdata(handler);
+	if (self->signal_fd >= 0)
+		return 0;
 
-	struct signalfd_siginfo fdsi;
-	(void)read(ctx->fd, &fdsi, sizeof(fdsi));
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = &self->signal_fd,
+	};
+	if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		close(fd);
+		return -1;
+	}
 
-	struct aml_signal* sig = aml_weak_ref_read(ctx->ref);
-	if (!sig)
-		return;
+	self->signal_fd = fd;
+	return 0;
+}
 
-	aml_emit(ctx->state->aml, sig, 0);
-	aml_unref(sig);
+static bool epoll_has_signo(struct epoll_state* self, int signo)
+{
+	for (size_t i = 0; i < self->n_signals; ++i)
+		if (aml_get_signo(self->signals[i]) == signo)
+			return true;
+	return false;
 }
 
 static int epoll_add_signal(void* state, struct aml_signal* sig)
 {
 	struct epoll_state* self = state;
+	int signo = aml_get_signo(sig);
 
-	struct epoll_signal* ctx = calloc(1, sizeof(*ctx));
-	if (!ctx)
-		return -1;
+	pthread_mutex_lock(&self->signal_mutex);
 
-	int signo = aml_get_signo(sig);
+	if (self->n_signals >= self->max_signals) {
+		size_t new_max = self->max_signals ? self->max_signals * 2 : 8;
+		struct aml_signal** signals = realloc(self->signals,
+				sizeof(*signals) * new_max);
+		if (!signals)
+			goto failure;
 
-	sigset_t ss;
-	sigemptyset(&ss);
-	sigaddset(&ss, signo);
+		self->signals = signals;
+		self->max_signals = new_max;
+	}
 
-	ctx->state = self;
-	ctx->ref = aml_weak_ref_new(sig);
+	if (!sigismember(&self->signal_mask, signo)) {
+		sigaddset(&self->signal_mask, signo);
 
-	ctx->fd = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
-	if (ctx->fd < 0)
-		goto signalfd_failure;
-		
-	struct aml_handler* handler =
-		aml_handler_new(ctx->fd, epoll_on_signal, ctx,
-				epoll_signal_cleanup);
-	if (!handler)
-		goto handler_failure;
+		if (epoll_update_signal_fd(self) < 0) {
+			sigdelset(&self->signal_mask, signo);
+			goto failure;
+		}
+	}
 
-	if (aml_start(self->aml, handler) < 0)
-		goto start_failure;
+	self->signals[self->n_signals++] = sig;
 
-	aml_set_backend_data(sig, handler);
+	pthread_mutex_unlock(&self->signal_mutex);
 
+	sigset_t ss;
+	sigemptyset(&ss);
+	sigaddset(&ss, signo);
 	pthread_sigmask(SIG_BLOCK, &ss, NULL);
 	return 0;
 
-start_failure:
-	aml_unref(handler);
-handler_failure:
-	close(ctx->fd);
-signalfd_failure:
-	free(ctx);
+failure:
+	pthread_mutex_unlock(&self->signal_mutex);
 	return -1;
 }
 
 static int epoll_del_signal(void* state, struct aml_signal* sig)
 {
 	struct epoll_state* self = state;
+	int rc = -1;
 
-	struct aml_handler* handler = aml_get_backend_data(sig);
-	assert(handler);
+	pthread_mutex_lock(&self->signal_mutex);
 
-	int rc = aml_stop(self->aml, handler);
-	if (rc >= 0)
-		aml_unref(handler);
+	for (size_t i = 0; i < self->n_signals; ++i) {
+		if (self->signals[i] != sig)
+			continue;
+
+		self->signals[i] = self->signals[--self->n_signals];
+		rc = 0;
+		break;
+	}
+
+	int signo = aml_get_signo(sig);
+	if (rc == 0 && !epoll_has_signo(self, signo)) {
+		sigdelset(&self->signal_mask, signo);
+		epoll_update_signal_fd(self);
+	}
 
+	pthread_mutex_unlock(&self->signal_mutex);
 	return rc;
 }
 
@@ -261,7 +351,7 @@ static int epoll_set_deadline(void* state, uint64_t deadline)
 	return timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &it, NULL);
 }
 
-const struct aml_backend implementation = {
+const struct aml_backend epoll_backend = {
 	.new_state = epoll_new_state,
 	.del_state = epoll_del_state,
 	.clock = CLOCK_MONOTONIC,
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AML_FRAMER_X86
+#include <immintrin.h>
+#endif
+
+#include "aml.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define AML_FRAMER_BATCH 64
+#define AML_FRAMER_READ_SIZE 65536
+#define AML_FRAMER_DEFAULT_MAX (1024 * 1024)
+
+/* Find up to max occurrences of delim in data and store their offsets in out.
+ * If max is reached, the search stops there and the caller resumes after the
+ * last offset.
+ */
+typedef size_t (*aml_framer_find_fn)(const char* data, size_t len, char delim,
+		size_t* out, size_t max);
+
+enum aml_framer_mode {
+	AML_FRAMER_DELIMITED = 0,
+	AML_FRAMER_LENGTH_PREFIXED,
+};
+
+struct aml_framer {
+	enum aml_framer_mode mode;
+	char delimiter;
+	int header_size;
+	size_t max_record_size;
+
+	aml_framer_fn cb;
+	void* userdata;
+
+	/* The start of a record that hasn't been completed yet. For delimited
+	 * records, the first `scanned` bytes are known not to contain a
+	 * delimiter.
+	 */
+	char* buf;
+	size_t len;
+	size_t cap;
+	size_t scanned;
+
+	struct aml_record batch[AML_FRAMER_BATCH];
+	size_t positions[AML_FRAMER_BATCH];
+};
+
+static aml_framer_find_fn aml__framer_find;
+static pthread_once_t aml__framer_find_once = PTHREAD_ONCE_INIT;
+
+static size_t aml__framer_find_tail(const char* data, size_t begin,
+		size_t len, char delim, size_t* out, size_t n, size_t max)
+{
+	for (size_t i = begin; i < len && n < max; ++i)
+		if (data[i] == delim)
+			out[n++] = i;
+
+	return n;
+}
+
+static size_t aml__framer_find_scalar(const char* data, size_t len,
+		char delim, size_t* out, size_t max)
+{
+	size_t n = 0;
+	const char* p = data;
+	const char* end = data + len;
+
+	while (n < max && p < end) {
+		p = memchr(p, delim, end - p);
+		if (!p)
+			break;
+
+		out[n++] = p++ - data;
+	}
+
+	return n;
+}
+
+#ifdef AML_FRAMER_X86
+/* Offsets are extracted from a 64 bit mask per 64 byte block. This beats
+ * calling memchr() per record when records are short.
+ */
+static inline size_t aml__framer_emit_mask(uint64_t mask, size_t base,
+		size_t* out, size_t n, size_t max)
+{
+	while (mask && n < max) {
+		out[n++] = base + __builtin_ctzll(mask);
+		mask &= mask - 1;
+	}
+
+	return n;
+}
+
+__attribute__((target("sse2")))
+static size_t aml__framer_find_sse2(const char* data, size_t len, char delim,
+		size_t* out, size_t max)
+{
+	__m128i needle = _mm_set1_epi8(delim);
+	size_t n = 0;
+	size_t i = 0;
+
+	for (; i + 64 <= len && n < max; i += 64) {
+		const __m128i* p = (const __m128i*)(data + i);
+		uint64_t m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_loadu_si128(p), needle));
+		uint64_t m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_loadu_si128(p + 1), needle));
+		uint64_t m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_loadu_si128(p + 2), needle));
+		uint64_t m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_loadu_si128(p + 3), needle));
+
+		uint64_t mask = m0 | m1 << 16 | m2 << 32 | m3 << 48;
+		n = aml__framer_emit_mask(mask, i, out, n, max);
+	}
+
+	return aml__framer_find_tail(data, i, len, delim, out, n, max);
+}
+
+__attribute__((target("avx2")))
+static size_t aml__framer_find_avx2(const char* data, size_t len, char delim,
+		size_t* out, size_t max)
+{
+	__m256i needle = _mm256_set1_epi8(delim);
+	size_t n = 0;
+	size_t i = 0;
+
+	for (; i + 64 <= len && n < max; i += 64) {
+		const __m256i* p = (const __m256i*)(data + i);
+		uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+					_mm256_loadu_si256(p), needle));
+		uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+					_mm256_loadu_si256(p + 1), needle));
+
+		n = aml__framer_emit_mask(lo | hi << 32, i, out, n, max);
+	}
+
+	return aml__framer_find_tail(data, i, len, delim, out, n, max);
+}
+#endif
+
+static void aml__framer_select_find(void)
+{
+	aml__framer_find = aml__framer_find_scalar;
+
+#ifdef AML_FRAMER_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		aml__framer_find = aml__framer_find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		aml__framer_find = aml__framer_find_sse2;
+#endif
+}
+
+static struct aml_framer* aml_framer__new(enum aml_framer_mode mode,
+		size_t max_record_size, aml_framer_fn cb, void* userdata)
+{
+	pthread_once(&aml__framer_find_once, aml__framer_select_find);
+
+	struct aml_framer* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->mode = mode;
+	self->max_record_size = max_record_size ? max_record_size :
+		AML_FRAMER_DEFAULT_MAX;
+	self->cb = cb;
+	self->userdata = userdata;
+
+	return self;
+}
+
+EXPORT
+struct aml_framer* aml_framer_new_delimited(char delimiter,
+		size_t max_record_size, aml_framer_fn cb, void* userdata)
+{
+	struct aml_framer* self = aml_framer__new(AML_FRAMER_DELIMITED,
+			max_record_size, cb, userdata);
+	if (!self)
+		return NULL;
+
+	self->delimiter = delimiter;
+	return self;
+}
+
+EXPORT
+struct aml_framer* aml_framer_new_length_prefixed(int header_size,
+		size_t max_record_size, aml_framer_fn cb, void* userdata)
+{
+	if (header_size != 1 && header_size != 2 && header_size != 4) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct aml_framer* self = aml_framer__new(AML_FRAMER_LENGTH_PREFIXED,
+			max_record_size, cb, userdata);
+	if (!self)
+		return NULL;
+
+	self->header_size = header_size;
+	return self;
+}
+
+EXPORT
+void aml_framer_del(struct aml_framer* self)
+{
+	if (!self)
+		return;
+
+	free(self->buf);
+	free(self);
+}
+
+static int aml_framer__reserve(struct aml_framer* self, size_t cap)
+{
+	if (cap <= self->cap)
+		return 0;
+
+	size_t new_cap = self->cap ? self->cap * 2 : 256;
+	while (new_cap < cap)
+		new_cap *= 2;
+
+	char* buf = realloc(self->buf, new_cap);
+	if (!buf)
+		return -1;
+
+	self->buf = buf;
+	self->cap = new_cap;
+	return 0;
+}
+
+static int aml_framer__append(struct aml_framer* self, const char* data,
+		size_t len)
+{
+	if (aml_framer__reserve(self, self->len + len) < 0)
+		return -1;
+
+	memcpy(self->buf + self->len, data, len);
+	self->len += len;
+	return 0;
+}
+
+static size_t aml_framer__read_length(const struct aml_framer* self,
+		const char* data)
+{
+	const unsigned char* p = (const unsigned char*)data;
+
+	switch (self->header_size) {
+	case 1: return p[0];
+	case 2: return (size_t)p[0] << 8 | p[1];
+	case 4: return (size_t)p[0] << 24 | (size_t)p[1] << 16 |
+		(size_t)p[2] << 8 | p[3];
+	}
+
+	abort();
+	return 0;
+}
+
+/* Returns: the number of bytes that make up complete records, all of which
+ * have been delivered, or -1 on error.
+ */
+static ssize_t aml_framer__process_delimited(struct aml_framer* self,
+		const char* data, size_t len, size_t skip)
+{
+	size_t start = 0;
+	size_t pos = skip;
+
+	for (;;) {
+		size_t n = aml__framer_find(data + pos, len - pos,
+				self->delimiter, self->positions,
+				AML_FRAMER_BATCH);
+
+		for (size_t i = 0; i < n; ++i) {
+			size_t end = pos + self->positions[i];
+			if (end - start > self->max_record_size)
+				goto too_long;
+
+			self->batch[i].data = data + start;
+			self->batch[i].len = end - start;
+			start = end + 1;
+		}
+
+		if (n > 0)
+			self->cb(self->userdata, self->batch, n);
+
+		if (n < AML_FRAMER_BATCH)
+			break;
+
+		pos = start;
+	}
+
+	if (len - start > self->max_record_size)
+		goto too_long;
+
+	return start;
+
+too_long:
+	errno = EMSGSIZE;
+	return -1;
+}
+
+static ssize_t aml_framer__process_length_prefixed(struct aml_framer* self,
+		const char* data, size_t len)
+{
+	size_t hs = self->header_size;
+	size_t start = 0;
+
+	for (;;) {
+		size_t n = 0;
+
+		while (n < AML_FRAMER_BATCH && len - start >= hs) {
+			size_t record_len = aml_framer__read_length(self,
+					data + start);
+			if (record_len > self->max_record_size) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+
+			if (len - start - hs < record_len)
+				break;
+
+			self->batch[n].data = data + start + hs;
+			self->batch[n].len = record_len;
+			start += hs + record_len;
+			n++;
+		}
+
+		if (n > 0)
+			self->cb(self->userdata, self->batch, n);
+
+		if (n < AML_FRAMER_BATCH)
+			break;
+	}
+
+	return start;
+}
+
+static ssize_t aml_framer__process(struct aml_framer* self, const char* data,
+		size_t len, size_t skip)
+{
+	return self->mode == AML_FRAMER_DELIMITED ?
+		aml_framer__process_delimited(self, data, len, skip) :
+		aml_framer__process_length_prefixed(self, data, len);
+}
+
+/* Append only as much of the new data as is needed to complete the buffered
+ * record, so that the rest can be framed in place.
+ *
+ * Returns: the number of bytes consumed or -1 on error.
+ */
+static ssize_t aml_framer__complete_delimited(struct aml_framer* self,
+		const char* data, size_t len)
+{
+	size_t pos;
+	if (aml__framer_find(data, len, self->delimiter, &pos, 1) == 0) {
+		if (self->len + len > self->max_record_size) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		if (aml_framer__append(self, data, len) < 0)
+			return -1;
+
+		self->scanned = self->len;
+		return len;
+	}
+
+	if (self->len + pos > self->max_record_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (aml_framer__append(self, data, pos) < 0)
+		return -1;
+
+	struct aml_record record = { .data = self->buf, .len = self->len };
+	self->cb(self->userdata, &record, 1);
+
+	self->len = 0;
+	self->scanned = 0;
+	return pos + 1;
+}
+
+static ssize_t aml_framer__complete_length_prefixed(struct aml_framer* self,
+		const char* data, size_t len)
+{
+	size_t hs = self->header_size;
+	size_t used = 0;
+
+	if (self->len < hs) {
+		used = hs - self->len < len ? hs - self->len : len;
+		if (aml_framer__append(self, data, used) < 0)
+			return -1;
+
+		if (self->len < hs)
+			return used;
+	}
+
+	size_t record_len = aml_framer__read_length(self, self->buf);
+	if (record_len > self->max_record_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	size_t missing = hs + record_len - self->len;
+	size_t n = missing < len - used ? missing : len - used;
+	if (aml_framer__append(self, data + used, n) < 0)
+		return -1;
+
+	used += n;
+	if (n < missing)
+		return used;
+
+	struct aml_record record = {
+		.data = self->buf + hs,
+		.len = record_len,
+	};
+	self->cb(self->userdata, &record, 1);
+
+	self->len = 0;
+	return used;
+}
+
+EXPORT
+int aml_framer_feed(struct aml_framer* self, const void* data, size_t len)
+{
+	const char* p = data;
+
+	if (self->len > 0) {
+		ssize_t used = self->mode == AML_FRAMER_DELIMITED ?
+			aml_framer__complete_delimited(self, p, len) :
+			aml_framer__complete_length_prefixed(self, p, len);
+		if (used < 0)
+			return -1;
+
+		if (self->len > 0)
+			return 0;
+
+		p += used;
+		len -= used;
+	}
+
+	ssize_t used = aml_framer__process(self, p, len, 0);
+	if (used < 0)
+		return -1;
+
+	if (aml_framer__append(self, p + used, len - used) < 0)
+		return -1;
+
+	self->scanned = self->len;
+	return 0;
+}
+
+EXPORT
+ssize_t aml_framer_read(struct aml_framer* self, int fd)
+{
+	if (aml_framer__reserve(self, self->len + AML_FRAMER_READ_SIZE) < 0)
+		return -1;
+
+	ssize_t rc = read(fd, self->buf + self->len, self->cap - self->len);
+	if (rc <= 0)
+		return rc;
+
+	self->len += rc;
+
+	ssize_t used = aml_framer__process(self, self->buf, self->len,
+			self->scanned);
+	if (used < 0)
+		return -1;
+
+	self->len -= used;
+	memmove(self->buf, self->buf + used, self->len);
+	self->scanned = self->len;
+
+	return rc;
+}
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "aml.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* Number of work items that may be in flight at a time per context */
+#define AML_FS_N_LANES 4
+
+/* Requests are allocated in chunks of this many and never freed until the
+ * context is deleted.
+ */
+#define AML_FS_CHUNK_SIZE 64
+
+enum aml_fs_op {
+	AML_FS_OP_OPEN,
+	AML_FS_OP_CLOSE,
+	AML_FS_OP_PREAD,
+	AML_FS_OP_PWRITE,
+	AML_FS_OP_FSYNC,
+	AML_FS_OP_STAT,
+	AML_FS_OP_RENAME,
+	AML_FS_OP_UNLINK,
+};
+
+struct aml_fs_req {
+	enum aml_fs_op op;
+
+	int fd;
+	int flags;
+	int mode;
+	void* buf;
+	size_t len;
+	off_t offset;
+	const char* path;
+	const char* new_path;
+	struct stat* st;
+
+	aml_fs_callback_fn cb;
+	void* userdata;
+
+	ssize_t result;
+
+	struct aml_fs_req* next;
+};
+
+struct aml_fs_req_list {
+	struct aml_fs_req* head;
+	struct aml_fs_req** tail;
+};
+
+struct aml_fs_chunk {
+	struct aml_fs_chunk* next;
+	struct aml_fs_req reqs[AML_FS_CHUNK_SIZE];
+};
+
+struct aml_fs_lane {
+	struct aml_fs* fs;
+	struct aml_work* work;
+	bool busy;
+
+	/* Only touched by the worker while busy and by the main loop
+	 * otherwise.
+	 */
+	struct aml_fs_req_list batch;
+};
+
+struct aml_fs {
+	struct aml* aml;
+
+	pthread_mutex_t mutex;
+	struct aml_fs_req_list queue;
+	struct aml_fs_req* free_list;
+	struct aml_fs_chunk* chunks;
+
+	struct aml_fs_lane lanes[AML_FS_N_LANES];
+	int n_busy;
+	bool closing;
+	bool in_callback;
+};
+
+static void aml_fs__list_init(struct aml_fs_req_list* list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+static void aml_fs__list_append(struct aml_fs_req_list* list,
+		struct aml_fs_req* req)
+{
+	req->next = NULL;
+	*list->tail = req;
+	list->tail = &req->next;
+}
+
+static ssize_t aml_fs__result(ssize_t rc)
+{
+	return rc < 0 ? -errno : rc;
+}
+
+static void aml_fs__execute(struct aml_fs_req* req)
+{
+	switch (req->op) {
+	case AML_FS_OP_OPEN:
+		req->result = aml_fs__result(open(req->path, req->flags,
+					req->mode));
+		break;
+	case AML_FS_OP_CLOSE:
+		req->result = aml_fs__result(close(req->fd));
+		break;
+	case AML_FS_OP_PREAD:
+		req->result = aml_fs__result(pread(req->fd, req->buf, req->len,
+					req->offset));
+		break;
+	case AML_FS_OP_PWRITE:
+		req->result = aml_fs__result(pwrite(req->fd, req->buf,
+					req->len, req->offset));
+		break;
+	case AML_FS_OP_FSYNC:
+		req->result = aml_fs__result(fsync(req->fd));
+		break;
+	case AML_FS_OP_STAT:
+		req->result = aml_fs__result(stat(req->path, req->st));
+		break;
+	case AML_FS_OP_RENAME:
+		req->result = aml_fs__result(rename(req->path, req->new_path));
+		break;
+	case AML_FS_OP_UNLINK:
+		req->result = aml_fs__result(unlink(req->path));
+		break;
+	}
+}
+
+static void aml_fs__work_fn(void* obj)
+{
+	struct aml_fs_lane* lane = aml_get_userdata(obj);
+	struct aml_fs* fs = lane->fs;
+
+	/* Requests that are submitted while the batch is being executed are
+	 * picked up in the same run, so a busy lane doesn't have to wait for
+	 * the main loop before it can continue.
+	 */
+	while (1) {
+		pthread_mutex_lock(&fs->mutex);
+		struct aml_fs_req* req = fs->queue.head;
+		if (req) {
+			fs->queue.head = req->next;
+			if (!fs->queue.head)
+				fs->queue.tail = &fs->queue.head;
+		}
+		pthread_mutex_unlock(&fs->mutex);
+
+		if (!req)
+			break;
+
+		aml_fs__execute(req);
+		aml_fs__list_append(&lane->batch, req);
+	}
+}
+
+static void aml_fs__free(struct aml_fs* fs)
+{
+	for (int i = 0; i < AML_FS_N_LANES; ++i)
+		if (fs->lanes[i].work)
+			aml_unref(fs->lanes[i].work);
+
+	while (fs->chunks) {
+		struct aml_fs_chunk* chunk = fs->chunks;
+		fs->chunks = chunk->next;
+		free(chunk);
+	}
+
+	pthread_mutex_destroy(&fs->mutex);
+	free(fs);
+}
+
+static int aml_fs__start_lane(struct aml_fs* fs, struct aml_fs_lane* lane)
+{
+	lane->busy = true;
+	fs->n_busy++;
+
+	if (aml_start(fs->aml, lane->work) == 0)
+		return 0;
+
+	lane->busy = false;
+	fs->n_busy--;
+	return -1;
+}
+
+/* Call the callbacks of finished requests and recycle them.
+ *
+ * Returns: false if the context was deleted from within a callback.
+ */
+static bool aml_fs__complete(struct aml_fs* fs, struct aml_fs_req* reqs)
+{
+	/* Callbacks may submit new requests, so the finished ones are only
+	 * returned to the free list afterwards. They may also delete the
+	 * context, which is then freed here once the callbacks are done.
+	 */
+	struct aml_fs_req* last = NULL;
+	fs->in_callback = true;
+	for (struct aml_fs_req* it = reqs; it; it = it->next) {
+		if (!fs->closing)
+			it->cb(it->userdata, it->result);
+		last = it;
+	}
+	fs->in_callback = false;
+
+	if (fs->closing) {
+		if (fs->n_busy == 0)
+			aml_fs__free(fs);
+		return false;
+	}
+
+	pthread_mutex_lock(&fs->mutex);
+	if (last) {
+		last->next = fs->free_list;
+		fs->free_list = reqs;
+	}
+	pthread_mutex_unlock(&fs->mutex);
+	return true;
+}
+
+/* Busy lanes pick up whatever is queued, but if none are left, queued
+ * requests would never be executed, so they fail instead.
+ */
+static void aml_fs__fail_queued(struct aml_fs* fs, int error)
+{
+	if (fs->n_busy > 0)
+		return;
+
+	pthread_mutex_lock(&fs->mutex);
+	struct aml_fs_req* reqs = fs->queue.head;
+	aml_fs__list_init(&fs->queue);
+	pthread_mutex_unlock(&fs->mutex);
+
+	for (struct aml_fs_req* it = reqs; it; it = it->next)
+		it->result = -error;
+
+	aml_fs__complete(fs, reqs);
+}
+
+static void aml_fs__done_fn(void* obj)
+{
+	struct aml_fs_lane* lane = aml_get_userdata(obj);
+	struct aml_fs* fs = lane->fs;
+
+	struct aml_fs_req* req = lane->batch.head;
+	aml_fs__list_init(&lane->batch);
+
+	lane->busy = false;
+	fs->n_busy--;
+
+	if (!aml_fs__complete(fs, req))
+		return;
+
+	pthread_mutex_lock(&fs->mutex);
+	bool have_more = fs->queue.head != NULL;
+	pthread_mutex_unlock(&fs->mutex);
+
+	if (have_more && aml_fs__start_lane(fs, lane) < 0)
+		aml_fs__fail_queued(fs, errno);
+}
+
+EXPORT
+struct aml_fs* aml_fs_new(struct aml* aml)
+{
+	struct aml_fs* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->aml = aml;
+	aml_fs__list_init(&self->queue);
+	pthread_mutex_init(&self->mutex, NULL);
+
+	for (int i = 0; i < AML_FS_N_LANES; ++i) {
+		struct aml_fs_lane* lane = &self->lanes[i];
+		lane->fs = self;
+		aml_fs__list_init(&lane->batch);
+
+		lane->work = aml_work_new(aml_fs__work_fn, aml_fs__done_fn,
+				lane, NULL);
+		if (!lane->work)
+			goto failure;
+	}
+
+	if (aml_require_workers(aml, AML_FS_N_LANES) < 0)
+		goto failure;
+
+	return self;
+
+failure:
+	aml_fs__free(self);
+	return NULL;
+}
+
+EXPORT
+void aml_fs_del(struct aml_fs* self)
+{
+	if (!self)
+		return;
+
+	/* Requests that haven't been picked up yet are simply dropped, but
+	 * the ones that are being executed must finish before the context
+	 * can be freed.
+	 */
+	pthread_mutex_lock(&self->mutex);
+	aml_fs__list_init(&self->queue);
+	pthread_mutex_unlock(&self->mutex);
+
+	self->closing = true;
+
+	if (self->n_busy == 0 && !self->in_callback)
+		aml_fs__free(self);
+}
+
+static struct aml_fs_req* aml_fs__get_req(struct aml_fs* self)
+{
+	if (!self->free_list) {
+		struct aml_fs_chunk* chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+
+		chunk->next = self->chunks;
+		self->chunks = chunk;
+
+		for (int i = 0; i < AML_FS_CHUNK_SIZE; ++i) {
+			chunk->reqs[i].next = self->free_list;
+			self->free_list = &chunk->reqs[i];
+		}
+	}
+
+	struct aml_fs_req* req = self->free_list;
+	self->free_list = req->next;
+	return req;
+}
+
+/* Take back a request that no lane is going to execute */
+static void aml_fs__unqueue(struct aml_fs* self, struct aml_fs_req* req)
+{
+	pthread_mutex_lock(&self->mutex);
+
+	struct aml_fs_req** link = &self->queue.head;
+	while (*link && *link != req)
+		link = &(*link)->next;
+
+	if (*link) {
+		*link = req->next;
+		if (!*link)
+			self->queue.tail = link;
+
+		req->next = self->free_list;
+		self->free_list = req;
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+static int aml_fs__submit(struct aml_fs* self, const struct aml_fs_req* tmpl)
+{
+	pthread_mutex_lock(&self->mutex);
+
+	struct aml_fs_req* req = aml_fs__get_req(self);
+	if (!req) {
+		pthread_mutex_unlock(&self->mutex);
+		return -1;
+	}
+
+	*req = *tmpl;
+	aml_fs__list_append(&self->queue, req);
+
+	pthread_mutex_unlock(&self->mutex);
+
+	/* Running lanes keep taking requests from the queue until it's empty,
+	 * so once all lanes are busy, requests pile up and get executed in
+	 * batches without any further scheduling.
+	 */
+	for (int i = 0; i < AML_FS_N_LANES; ++i) {
+		struct aml_fs_lane* lane = &self->lanes[i];
+		if (lane->busy)
+			continue;
+
+		/* If other lanes are busy, they'll get to it */
+		if (aml_fs__start_lane(self, lane) < 0 && self->n_busy == 0) {
+			aml_fs__unqueue(self, req);
+			return -1;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+EXPORT
+int aml_fs_open(struct aml_fs* self, const char* path, int flags, int mode,
+                aml_fs_callback_fn cb, void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_OPEN,
+		.path = path,
+		.flags = flags,
+		.mode = mode,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_close(struct aml_fs* self, int fd, aml_fs_callback_fn cb,
+                 void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_CLOSE,
+		.fd = fd,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_pread(struct aml_fs* self, int fd, void* buf, size_t len,
+                 off_t offset, aml_fs_callback_fn cb, void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_PREAD,
+		.fd = fd,
+		.buf = buf,
+		.len = len,
+		.offset = offset,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_pwrite(struct aml_fs* self, int fd, const void* buf, size_t len,
+                  off_t offset, aml_fs_callback_fn cb, void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_PWRITE,
+		.fd = fd,
+		.buf = (void*)buf,
+		.len = len,
+		.offset = offset,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_fsync(struct aml_fs* self, int fd, aml_fs_callback_fn cb,
+                 void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_FSYNC,
+		.fd = fd,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_stat(struct aml_fs* self, const char* path, struct stat* st,
+                aml_fs_callback_fn cb, void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_STAT,
+		.path = path,
+		.st = st,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_rename(struct aml_fs* self, const char* old_path,
+                  const char* new_path, aml_fs_callback_fn cb, void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_RENAME,
+		.path = old_path,
+		.new_path = new_path,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
+
+EXPORT
+int aml_fs_unlink(struct aml_fs* self, const char* path, aml_fs_callback_fn cb,
+                  void* userdata)
+{
+	struct aml_fs_req req = {
+		.op = AML_FS_OP_UNLINK,
+		.path = path,
+		.cb = cb,
+		.userdata = userdata,
+	};
+	return aml_fs__submit(self, &req);
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "aml.h"
+#include "backend.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+struct aml_fsync_waiter {
+	aml_fs_callback_fn cb;
+	void* userdata;
+};
+
+struct aml_fsync_waiter_list {
+	struct aml_fsync_waiter* waiters;
+	size_t len;
+	size_t cap;
+};
+
+struct aml_fsync_group {
+	struct aml* aml;
+	int fd;
+
+	struct aml_work* work;
+	ssize_t result;
+
+	pthread_mutex_t mutex;
+	bool in_flight;
+	bool closing;
+
+	/* Requests that arrive while a sync is in flight may have written
+	 * data after it started, so they wait for the next one. The lists
+	 * are swapped when a sync is started.
+	 */
+	struct aml_fsync_waiter_list pending;
+	struct aml_fsync_waiter_list syncing;
+};
+
+static void aml_fsync_group__free(struct aml_fsync_group* self)
+{
+	if (self->work)
+		aml_unref(self->work);
+
+	pthread_mutex_destroy(&self->mutex);
+	free(self->pending.waiters);
+	free(self->syncing.waiters);
+	free(self);
+}
+
+static void aml_fsync_group__work_fn(void* obj)
+{
+	struct aml_fsync_group* self = aml_get_userdata(obj);
+
+	self->result = fdatasync(self->fd) < 0 ? -errno : 0;
+}
+
+/* Called with the mutex held */
+static int aml_fsync_group__start(struct aml_fsync_group* self)
+{
+	struct aml_fsync_waiter_list tmp = self->syncing;
+	self->syncing = self->pending;
+	self->pending = tmp;
+	self->pending.len = 0;
+
+	self->in_flight = true;
+
+	/* Requests may come from any thread */
+	if (aml_start_from_any_thread(self->aml, self->work) == 0)
+		return 0;
+
+	/* Put the requests back so that they're covered by the next try */
+	tmp = self->pending;
+	self->pending = self->syncing;
+	self->syncing = tmp;
+
+	self->in_flight = false;
+	return -1;
+}
+
+static void aml_fsync_group__done_fn(void* obj)
+{
+	struct aml_fsync_group* self = aml_get_userdata(obj);
+
+	if (self->closing) {
+		aml_fsync_group__free(self);
+		return;
+	}
+
+	/* Only the main loop touches the syncing list while no sync is in
+	 * flight, so callbacks are called without holding the lock.
+	 */
+	for (size_t i = 0; i < self->syncing.len; ++i) {
+		struct aml_fsync_waiter* waiter = &self->syncing.waiters[i];
+		waiter->cb(waiter->userdata, self->result);
+	}
+	self->syncing.len = 0;
+
+	pthread_mutex_lock(&self->mutex);
+	self->in_flight = false;
+	if (self->pending.len > 0)
+		aml_fsync_group__start(self);
+	pthread_mutex_unlock(&self->mutex);
+}
+
+EXPORT
+struct aml_fsync_group* aml_fsync_group_new(struct aml* aml, int fd)
+{
+	struct aml_fsync_group* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->aml = aml;
+	self->fd = fd;
+	pthread_mutex_init(&self->mutex, NULL);
+
+	self->work = aml_work_new(aml_fsync_group__work_fn,
+			aml_fsync_group__done_fn, self, NULL);
+	if (!self->work)
+		goto failure;
+
+	if (aml_require_workers(aml, 1) < 0)
+		goto failure;
+
+	return self;
+
+failure:
+	aml_fsync_group__free(self);
+	return NULL;
+}
+
+EXPORT
+void aml_fsync_group_del(struct aml_fsync_group* self)
+{
+	if (!self)
+		return;
+
+	pthread_mutex_lock(&self->mutex);
+	bool in_flight = self->in_flight;
+	self->closing = true;
+	pthread_mutex_unlock(&self->mutex);
+
+	/* An in-flight sync still needs the group, so it frees it instead */
+	if (!in_flight)
+		aml_fsync_group__free(self);
+}
+
+EXPORT
+int aml_fsync_group_sync(struct aml_fsync_group* self, aml_fs_callback_fn cb,
+                         void* userdata)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&self->mutex);
+
+	struct aml_fsync_waiter_list* list = &self->pending;
+	if (list->len >= list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 16;
+		struct aml_fsync_waiter* waiters =
+			realloc(list->waiters, cap * sizeof(*waiters));
+		if (!waiters)
+			goto done;
+
+		list->waiters = waiters;
+		list->cap = cap;
+	}
+
+	list->waiters[list->len++] = (struct aml_fsync_waiter) {
+		.cb = cb,
+		.userdata = userdata,
+	};
+
+	rc = 0;
+	if (!self->in_flight && aml_fsync_group__start(self) < 0) {
+		self->pending.len--;
+		rc = -1;
+	}
+
+done:
+	pthread_mutex_unlock(&self->mutex);
+	return rc;
+}
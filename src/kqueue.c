@@ -73,6 +73,8 @@ static void kq_emit_event(struct kq_state* self, struct kevent* event)
 		aml_emit(self->aml, event->udata, AML_EVENT_WRITE);
 		break;
 	case EVFILT_SIGNAL:
+		/* The number of deliveries since the last event is in data */
+		aml_signal_queue_info(event->udata, NULL, event->data);
 		aml_emit(self->aml, event->udata, 0);
 		break;
 	case EVFILT_TIMER:
@@ -106,7 +108,7 @@ static int kq_add_fd(void* state, struct aml_handler* handler)
 	int fd = aml_get_fd(handler);
 
 	enum aml_event last_mask = (intptr_t)aml_get_backend_data(handler);
-	enum aml_event mask = aml_get_event_mask(handler);
+	enum aml_event mask = aml_get_active_event_mask(handler);
 	aml_set_backend_data(handler, (void*)(intptr_t)mask);
 
 	struct kevent events[2];
@@ -141,6 +143,9 @@ static int kq_del_fd(void* state, struct aml_handler* handler)
 	if (last_mask & AML_EVENT_WRITE)
 		EV_SET(&events[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
 
+	/* The handler may be started on another main loop later */
+	aml_set_backend_data(handler, NULL);
+
 	return kevent(self->fd, events, n, NULL, 0, NULL);
 }
 
@@ -195,7 +200,7 @@ static int kq_set_deadline(void* state, uint64_t deadline)
 	return kevent(self->fd, &event, 1, NULL, 0, NULL);
 }
 
-const struct aml_backend implementation = {
+const struct aml_backend kqueue_backend = {
 	.new_state = kq_new_state,
 	.del_state = kq_del_state,
 	.clock = CLOCK_REALTIME,
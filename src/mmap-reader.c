@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aml.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define AML_MMAP_DEFAULT_SLICE_SIZE (1 << 20)
+
+/* Number of slices that are prefetched ahead of the consumer */
+#define AML_MMAP_WINDOW 4
+
+struct aml_mmap_reader {
+	struct aml* aml;
+	int fd;
+
+	const char* data;
+	size_t size;
+	size_t slice_size;
+
+	aml_mmap_reader_fn cb;
+	void* userdata;
+
+	int rate;
+	bool started;
+	bool finished;
+
+	/* Everything before "delivered" has been handed to the consumer and
+	 * everything before "prefetched" is resident.
+	 */
+	size_t delivered;
+	size_t prefetched;
+
+	struct aml_work* work;
+	size_t prefetch_end;
+	bool prefetching;
+	bool closing;
+	bool in_callback;
+
+	struct aml_idle* idle;
+};
+
+static void aml_mmap_reader__free(struct aml_mmap_reader* self)
+{
+	if (self->idle) {
+		aml_stop(self->aml, self->idle);
+		aml_unref(self->idle);
+	}
+
+	if (self->work)
+		aml_unref(self->work);
+
+	if (self->data)
+		munmap((void*)self->data, self->size);
+
+	free(self);
+}
+
+static void aml_mmap_reader__prefetch_fn(void* obj)
+{
+	struct aml_mmap_reader* self = aml_get_userdata(obj);
+
+	size_t begin = self->prefetched;
+	size_t len = self->prefetch_end - begin;
+
+	posix_madvise((void*)(self->data + begin), len, POSIX_MADV_WILLNEED);
+#ifdef __linux__
+	readahead(self->fd, begin, len);
+#endif
+
+	/* Touching the pages faults them in here rather than on the main
+	 * loop.
+	 */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = begin; i < self->prefetch_end; i += page_size)
+		(void)*(volatile const char*)(self->data + i);
+}
+
+static void aml_mmap_reader__prefetch_done(void* obj)
+{
+	struct aml_mmap_reader* self = aml_get_userdata(obj);
+
+	self->prefetching = false;
+
+	if (self->closing) {
+		aml_mmap_reader__free(self);
+		return;
+	}
+
+	self->prefetched = self->prefetch_end;
+}
+
+static void aml_mmap_reader__maybe_prefetch(struct aml_mmap_reader* self)
+{
+	if (self->prefetching || self->prefetched == self->size)
+		return;
+
+	size_t window = AML_MMAP_WINDOW * self->slice_size;
+	if (self->prefetched >= self->delivered + window / 2)
+		return;
+
+	size_t end = self->delivered + window;
+	self->prefetch_end = end < self->size ? end : self->size;
+	self->prefetching = true;
+
+	if (aml_start(self->aml, self->work) < 0)
+		self->prefetching = false;
+}
+
+/* Returns: false if the reader was deleted from within the callback */
+static bool aml_mmap_reader__deliver(struct aml_mmap_reader* self,
+		uint64_t offset, const void* data, size_t len)
+{
+	self->in_callback = true;
+	self->cb(self->userdata, offset, data, len);
+	self->in_callback = false;
+
+	if (!self->closing)
+		return true;
+
+	if (!self->prefetching)
+		aml_mmap_reader__free(self);
+	return false;
+}
+
+static void aml_mmap_reader__on_idle(void* obj)
+{
+	struct aml_mmap_reader* self = aml_get_userdata(obj);
+
+	for (int i = 0; i < self->rate && self->delivered < self->prefetched;
+			++i) {
+		size_t offset = self->delivered;
+		size_t len = self->prefetched - offset;
+		if (len > self->slice_size)
+			len = self->slice_size;
+
+		self->delivered += len;
+		if (!aml_mmap_reader__deliver(self, offset,
+					self->data + offset, len))
+			return;
+	}
+
+	if (self->delivered == self->size) {
+		if (!self->finished) {
+			self->finished = true;
+			aml_stop(self->aml, self->idle);
+			aml_mmap_reader__deliver(self, self->size, NULL, 0);
+		}
+		return;
+	}
+
+	aml_mmap_reader__maybe_prefetch(self);
+
+	/* Idle callbacks only run when the loop wakes up for some other
+	 * reason, so it needs a nudge while there are slices to deliver.
+	 */
+	if (self->rate > 0 && self->delivered < self->prefetched)
+		aml_interrupt(self->aml);
+}
+
+EXPORT
+struct aml_mmap_reader* aml_mmap_reader_new(struct aml* aml, int fd,
+		size_t slice_size, aml_mmap_reader_fn cb, void* userdata)
+{
+	struct aml_mmap_reader* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->aml = aml;
+	self->fd = fd;
+	self->cb = cb;
+	self->userdata = userdata;
+	self->rate = 1;
+
+	/* Slices are kept page aligned */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (slice_size == 0)
+		slice_size = AML_MMAP_DEFAULT_SLICE_SIZE;
+	self->slice_size = (slice_size + page_size - 1) & ~(page_size - 1);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	self->size = st.st_size;
+	if (self->size > 0) {
+		void* data = mmap(NULL, self->size, PROT_READ, MAP_SHARED, fd,
+				0);
+		if (data == MAP_FAILED)
+			goto failure;
+
+		self->data = data;
+		posix_madvise(data, self->size, POSIX_MADV_SEQUENTIAL);
+	}
+
+	self->work = aml_work_new(aml_mmap_reader__prefetch_fn,
+			aml_mmap_reader__prefetch_done, self, NULL);
+	self->idle = aml_idle_new(aml_mmap_reader__on_idle, self, NULL);
+	if (!self->work || !self->idle)
+		goto failure;
+
+	if (aml_require_workers(aml, 1) < 0)
+		goto failure;
+
+	return self;
+
+failure:
+	aml_mmap_reader__free(self);
+	return NULL;
+}
+
+EXPORT
+void aml_mmap_reader_del(struct aml_mmap_reader* self)
+{
+	if (!self)
+		return;
+
+	/* The mapping must outlive a prefetch that is in progress, and a
+	 * delivery in progress frees the reader once the callback returns.
+	 */
+	if (self->prefetching || self->in_callback) {
+		self->closing = true;
+		aml_stop(self->aml, self->idle);
+		return;
+	}
+
+	aml_mmap_reader__free(self);
+}
+
+EXPORT
+int aml_mmap_reader_start(struct aml_mmap_reader* self)
+{
+	if (self->started)
+		return -1;
+
+	if (aml_start(self->aml, self->idle) < 0)
+		return -1;
+
+	self->started = true;
+	aml_mmap_reader__maybe_prefetch(self);
+	aml_interrupt(self->aml);
+	return 0;
+}
+
+EXPORT
+void aml_mmap_reader_set_rate(struct aml_mmap_reader* self, int rate)
+{
+	self->rate = rate;
+
+	if (self->started && rate > 0)
+		aml_interrupt(self->aml);
+}
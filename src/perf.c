@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "perf.h"
+
+#ifdef HAVE_PERF_EVENT
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+struct perf_group {
+	int leader_fd;
+	int fds[PERF_COUNTER_MAX];
+
+	/* Position of each counter within the group read buffer or -1 */
+	int index[PERF_COUNTER_MAX];
+	int n_open;
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf__events[PERF_COUNTER_MAX] = {
+	[PERF_COUNTER_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_COUNTER_INSTRUCTIONS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_COUNTER_CACHE_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_COUNTER_BRANCH_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	[PERF_COUNTER_CONTEXT_SWITCHES] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static int perf__open(enum perf_counter counter, int group_fd)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size = sizeof(attr);
+	attr.type = perf__events[counter].type;
+	attr.config = perf__events[counter].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = group_fd < 0;
+
+	/* Hardware counters are restricted to user space, so that this works
+	 * with the default perf_event_paranoid setting. Context switches
+	 * happen in the kernel, so they can't be excluded there, which means
+	 * that counting them requires perf_event_paranoid <= 1.
+	 */
+	if (attr.type == PERF_TYPE_HARDWARE) {
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+	}
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+struct perf_group* perf_group_new(void)
+{
+	struct perf_group* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->leader_fd = -1;
+
+	for (int i = 0; i < PERF_COUNTER_MAX; ++i) {
+		self->fds[i] = perf__open(i, self->leader_fd);
+		if (self->fds[i] < 0) {
+			self->index[i] = -1;
+			continue;
+		}
+
+		if (self->leader_fd < 0)
+			self->leader_fd = self->fds[i];
+
+		self->index[i] = self->n_open++;
+	}
+
+	if (self->leader_fd < 0) {
+		free(self);
+		return NULL;
+	}
+
+	ioctl(self->leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(self->leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	return self;
+}
+
+void perf_group_del(struct perf_group* self)
+{
+	if (!self)
+		return;
+
+	for (int i = 0; i < PERF_COUNTER_MAX; ++i)
+		if (self->fds[i] >= 0)
+			close(self->fds[i]);
+
+	free(self);
+}
+
+bool perf_group_has_counter(const struct perf_group* self,
+		enum perf_counter counter)
+{
+	return self->index[counter] >= 0;
+}
+
+int perf_group_read(struct perf_group* self,
+		uint64_t values[PERF_COUNTER_MAX])
+{
+	uint64_t buffer[1 + PERF_COUNTER_MAX];
+
+	ssize_t len = read(self->leader_fd, buffer, sizeof(buffer));
+	if (len < (ssize_t)sizeof(uint64_t))
+		return -1;
+
+	for (int i = 0; i < PERF_COUNTER_MAX; ++i)
+		values[i] = self->index[i] >= 0 ?
+			buffer[1 + self->index[i]] : 0;
+
+	return 0;
+}
+
+#else
+
+struct perf_group* perf_group_new(void)
+{
+	return NULL;
+}
+
+void perf_group_del(struct perf_group* self)
+{
+}
+
+bool perf_group_has_counter(const struct perf_group* self,
+		enum perf_counter counter)
+{
+	return false;
+}
+
+int perf_group_read(struct perf_group* self,
+		uint64_t values[PERF_COUNTER_MAX])
+{
+	memset(values, 0, sizeof(uint64_t) * PERF_COUNTER_MAX);
+	return -1;
+}
+
+#endif
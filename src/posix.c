@@ -24,38 +24,109 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include "aml.h"
 #include "backend.h"
 #include "sys/queue.h"
 
-struct posix_state;
+/* The first two pollfd entries are the loop's wake pipe and the signal pipe */
+#define POSIX_RESERVED_FDS 2
 
-typedef void (*fd_op_fn)(struct posix_state*, struct aml_handler*);
+/* Large enough for all signal numbers on the platforms that we support */
+#define POSIX_MAX_SIGNO 128
 
+enum posix_fd_op_type {
+	POSIX_FD_OP_NONE = 0,
+	POSIX_FD_OP_ADD,
+	POSIX_FD_OP_MOD,
+	POSIX_FD_OP_DEL,
+};
+
+/* There is at most one pending op per handler. Further requests for the same
+ * handler are merged into it so that only the net effect is applied.
+ */
 struct posix_fd_op {
 	struct aml_handler* handler;
-	fd_op_fn call;
-	TAILQ_ENTRY(posix_fd_op) link;
+	enum posix_fd_op_type type;
 };
 
-TAILQ_HEAD(posix_fd_op_queue, posix_fd_op);
+struct posix_fd_op_list {
+	struct posix_fd_op* ops;
+	uint32_t len;
+	uint32_t cap;
+};
 
 struct posix_state {
 	struct aml* aml;
 
+	/* The first entries are always the wake pipe and the signal pipe.
+	 * The rest belong to the handlers at the same index.
+	 */
 	struct pollfd* fds;
 	struct aml_handler** handlers;
 
+	/* Index + 1 of the pending op for the handler at the same index, or
+	 * zero if there is none.
+	 */
+	uint32_t* op_slots;
+
 	uint32_t max_fds;
 	uint32_t num_fds;
 
+	/* Larger arrays are allocated when an op is queued, so that applying
+	 * it can't fail, and are swapped in when it's applied. The arrays in
+	 * use can't be reallocated at that point because poll() may be using
+	 * them.
+	 */
+	struct pollfd* spare_fds;
+	struct aml_handler** spare_handlers;
+	uint32_t* spare_op_slots;
+	uint32_t spare_max_fds;
+
+	int wake_pipe_rfd, wake_pipe_wfd;
+
+	/* Set while poll() is being prepared or is blocking, so that others
+	 * know whether the poll needs to be woken up.
+	 */
+	atomic_bool polling;
+	atomic_bool interrupted;
+
+	/* Set when something has been written to the wake pipe that hasn't
+	 * been drained yet, so that a batch of changes only wakes poll() once.
+	 */
+	atomic_bool wake_pending;
+
+	atomic_uint_fast64_t deadline;
+
+	/* Ops are queued to "pending" and swapped into "applying" before
+	 * poll(), so neither array is reallocated in the steady state.
+	 */
+	struct posix_fd_op_list pending_ops;
+	struct posix_fd_op_list applying_ops;
+	pthread_mutex_t fd_ops_mutex;
+
+	/* A poller thread is only needed if the main loop is to be nested
+	 * within another main loop via aml_get_fd(). Otherwise, poll() is
+	 * called directly from posix_poll().
+	 *
+	 * aml_get_fd() may be called from any thread while the main loop is
+	 * polling, so whoever calls poll() holds poll_mutex. This keeps the
+	 * main loop and a freshly spawned poller from polling at the same
+	 * time.
+	 */
+	atomic_bool have_poller;
+	atomic_bool poller_quit;
 	pthread_t poller_thread;
+	pthread_mutex_t poll_mutex;
 
-	int event_pipe_rfd, event_pipe_wfd;
+	/* Only touched by the main loop's thread. Set while the poller waits
+	 * for the events that it handed over to be dispatched.
+	 */
+	bool poller_waiting;
 
-	struct posix_fd_op_queue fd_ops;
-	pthread_mutex_t fd_ops_mutex;
+	int event_pipe_rfd, event_pipe_wfd;
 
 	int nfds;
 	pthread_mutex_t wait_mutex;
@@ -75,41 +146,220 @@ struct signal_handler {
 
 LIST_HEAD(signal_handler_list, signal_handler);
 
-static int posix_spawn_poller(struct posix_state* self);
 static void posix_post_dispatch(void* state);
-static void posix_interrupt(void* state);
 
 static struct signal_handler_list signal_handlers = LIST_HEAD_INITIALIZER(NULL);
+static pthread_mutex_t signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The signal handler only touches the following, so that it stays
+ * async-signal-safe. The pipe is shared by all loops and whichever loop drains
+ * it turns the pending signals into events for all of them.
+ */
+static atomic_uint signal_pending[POSIX_MAX_SIGNO];
+static atomic_bool signal_wake_pending;
+static int signal_pipe_rfd = -1, signal_pipe_wfd = -1;
+static pthread_once_t signal_pipe_once = PTHREAD_ONCE_INIT;
+
+static void posix__wake(struct posix_state* self)
+{
+	if (atomic_exchange(&self->wake_pending, true))
+		return;
+
+	char one = 1;
+	write(self->wake_pipe_wfd, &one, sizeof(one));
+}
+
+/* Only wake up poll() if it's actually in progress. Otherwise, the change will
+ * be seen before poll() is called next.
+ */
+static void posix__wake_if_polling(struct posix_state* self)
+{
+	if (atomic_load(&self->polling))
+		posix__wake(self);
+}
+
+/* The backend data of a handler is its index in the fd array if it has been
+ * added, or the negated index + 1 of its pending op if it is waiting to be
+ * added. Zero means neither.
+ */
+static intptr_t posix__get_tag(struct aml_handler* handler)
+{
+	return (intptr_t)aml_get_backend_data(handler);
+}
+
+static void posix__set_tag(struct aml_handler* handler, intptr_t tag)
+{
+	aml_set_backend_data(handler, (void*)tag);
+}
+
+/* The backend data may have been left behind by another main loop, possibly
+ * with another backend, so a tag is only trusted if it points back at the
+ * handler.
+ *
+ * Returns: the index of the handler in the fd array or 0 if it hasn't been
+ * added.
+ */
+static uint32_t posix__handler_index(struct posix_state* self,
+		struct aml_handler* handler)
+{
+	intptr_t tag = posix__get_tag(handler);
+	if (tag < POSIX_RESERVED_FDS || tag >= self->num_fds ||
+			self->handlers[tag] != handler)
+		return 0;
+
+	return tag;
+}
+
+/* Returns: the pending op of a handler that is waiting to be added or NULL */
+static struct posix_fd_op* posix__find_add_op(struct posix_state* self,
+		struct aml_handler* handler)
+{
+	struct posix_fd_op_list* list = &self->pending_ops;
+
+	intptr_t tag = posix__get_tag(handler);
+	if (tag >= 0 || -tag - 1 >= list->len ||
+			list->ops[-tag - 1].handler != handler)
+		return NULL;
+
+	return &list->ops[-tag - 1];
+}
+
+static enum posix_fd_op_type posix__merge_fd_op(enum posix_fd_op_type old,
+		enum posix_fd_op_type new)
+{
+	switch (old) {
+	case POSIX_FD_OP_ADD:
+		/* The handler hasn't been added yet, so modifying it changes
+		 * nothing and deleting it cancels the add.
+		 */
+		return new == POSIX_FD_OP_DEL ? POSIX_FD_OP_NONE : old;
+	case POSIX_FD_OP_MOD:
+		return new == POSIX_FD_OP_DEL ? POSIX_FD_OP_DEL : old;
+	case POSIX_FD_OP_DEL:
+		/* Deleting and adding an fd again amounts to modifying it */
+		return new == POSIX_FD_OP_ADD ? POSIX_FD_OP_MOD : old;
+	case POSIX_FD_OP_NONE:
+		break;
+	}
+
+	abort();
+	return POSIX_FD_OP_NONE;
+}
 
-static int posix__enqueue_fd_op(struct posix_state* self, fd_op_fn call,
-                                struct aml_handler* handler)
+static int posix__grow_fd_op_list(struct posix_fd_op_list* list)
 {
-	struct posix_fd_op* op = calloc(1, sizeof(*op));
-	if (!op)
+	uint32_t cap = list->cap ? list->cap * 2 : 64;
+	struct posix_fd_op* ops = realloc(list->ops, sizeof(*ops) * cap);
+	if (!ops)
 		return -1;
 
-	aml_ref(handler);
+	list->ops = ops;
+	list->cap = cap;
+	return 0;
+}
 
-	op->call = call;
+static void posix__free_spare_fds(struct posix_state* self)
+{
+	free(self->spare_fds);
+	free(self->spare_handlers);
+	free(self->spare_op_slots);
+	self->spare_fds = NULL;
+	self->spare_handlers = NULL;
+	self->spare_op_slots = NULL;
+	self->spare_max_fds = 0;
+}
+
+/* Make sure that there's room for n fds once the pending ops are applied */
+static int posix__reserve_fds(struct posix_state* self, uint32_t n)
+{
+	if (n <= self->max_fds || n <= self->spare_max_fds)
+		return 0;
+
+	uint32_t max = self->max_fds * 2;
+	while (max < n)
+		max *= 2;
+
+	struct pollfd* fds = malloc(sizeof(*fds) * max);
+	struct aml_handler** handlers = malloc(sizeof(*handlers) * max);
+	uint32_t* op_slots = malloc(sizeof(*op_slots) * max);
+	if (!fds || !handlers || !op_slots) {
+		free(fds);
+		free(handlers);
+		free(op_slots);
+		return -1;
+	}
+
+	posix__free_spare_fds(self);
+
+	self->spare_fds = fds;
+	self->spare_handlers = handlers;
+	self->spare_op_slots = op_slots;
+	self->spare_max_fds = max;
+	return 0;
+}
+
+/* Must be called with fd_ops_mutex held */
+static int posix__enqueue_fd_op_locked(struct posix_state* self,
+		enum posix_fd_op_type type, struct aml_handler* handler)
+{
+	struct posix_fd_op_list* list = &self->pending_ops;
+	struct posix_fd_op* op = NULL;
+
+	uint32_t index = posix__handler_index(self, handler);
+	if (index > 0 && self->op_slots[index] != 0)
+		op = &list->ops[self->op_slots[index] - 1];
+	else if (index == 0)
+		op = posix__find_add_op(self, handler);
+
+	if (op) {
+		op->type = posix__merge_fd_op(op->type, type);
+		if (op->type == POSIX_FD_OP_NONE)
+			posix__set_tag(handler, 0);
+		return 0;
+	}
+
+	if (index == 0 && type != POSIX_FD_OP_ADD) {
+		/* Nothing to modify or delete */
+		return 0;
+	}
+
+	if (index > 0 && type == POSIX_FD_OP_ADD)
+		type = POSIX_FD_OP_MOD;
+
+	if (list->len >= list->cap && posix__grow_fd_op_list(list) < 0)
+		return -1;
+
+	/* Each pending op adds at most one fd */
+	if (type == POSIX_FD_OP_ADD &&
+			posix__reserve_fds(self, self->num_fds + list->len + 1) < 0)
+		return -1;
+
+	uint32_t slot = list->len++;
+	op = &list->ops[slot];
 	op->handler = handler;
+	op->type = type;
 
-	pthread_mutex_lock(&self->fd_ops_mutex);
-	TAILQ_INSERT_TAIL(&self->fd_ops, op, link);
-	pthread_mutex_unlock(&self->fd_ops_mutex);
+	aml_ref(handler);
 
-	posix_interrupt(self);
+	if (index > 0)
+		self->op_slots[index] = slot + 1;
+	else
+		posix__set_tag(handler, -(intptr_t)slot - 1);
 
 	return 0;
 }
 
-static struct posix_fd_op* posix__dequeue_fd_op(struct posix_state* self)
+static int posix__enqueue_fd_op(struct posix_state* self,
+		enum posix_fd_op_type type, struct aml_handler* handler)
 {
 	pthread_mutex_lock(&self->fd_ops_mutex);
-	struct posix_fd_op* op = TAILQ_FIRST(&self->fd_ops);
-	if (op)
-		TAILQ_REMOVE(&self->fd_ops, op, link);
+	int rc = posix__enqueue_fd_op_locked(self, type, handler);
 	pthread_mutex_unlock(&self->fd_ops_mutex);
-	return op;
+
+	if (rc == 0)
+		posix__wake_if_polling(self);
+
+	return rc;
 }
 
 static struct signal_handler* signal_handler_find_by_signo(int signo)
@@ -136,11 +386,52 @@ static struct signal_handler* signal_handler_find_by_obj(struct aml_signal* obj)
 
 static void posix__signal_handler(int signo)
 {
-	struct signal_handler* handler;
+	int saved_errno = errno;
 
-	LIST_FOREACH(handler, &signal_handlers, link)
-		if (aml_get_signo(handler->sig) == signo)
+	atomic_fetch_add(&signal_pending[signo], 1);
+
+	if (!atomic_exchange(&signal_wake_pending, true)) {
+		char one = 1;
+		write(signal_pipe_wfd, &one, sizeof(one));
+	}
+
+	errno = saved_errno;
+}
+
+static void posix__dispatch_signals(struct posix_state* self)
+{
+	/* This must be cleared before the pending counters are read so that
+	 * signals arriving from here on cause another wake-up.
+	 */
+	atomic_store(&signal_wake_pending, false);
+
+	pthread_mutex_lock(&signal_mutex);
+
+	for (int signo = 1; signo < POSIX_MAX_SIGNO; ++signo) {
+		if (atomic_load(&signal_pending[signo]) == 0)
+			continue;
+
+		unsigned int count = atomic_exchange(&signal_pending[signo], 0);
+		if (count == 0)
+			continue;
+
+		struct signal_handler* handler;
+		LIST_FOREACH(handler, &signal_handlers, link) {
+			if (aml_get_signo(handler->sig) != signo)
+				continue;
+
+			/* The plain signal handler has no siginfo to offer */
+			aml_signal_queue_info(handler->sig, NULL, count);
 			aml_emit(handler->state->aml, handler->sig, 0);
+
+			if (handler->state == self)
+				atomic_store(&self->interrupted, true);
+			else
+				aml_interrupt(handler->state->aml);
+		}
+	}
+
+	pthread_mutex_unlock(&signal_mutex);
 }
 
 static void dont_block(int fd)
@@ -148,7 +439,7 @@ static void dont_block(int fd)
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-static int posix_init_event_pipe(struct posix_state* self)
+static int posix__init_pipe(int* rfd, int* wfd)
 {
 	int fds[2];
 	if (pipe(fds) < 0)
@@ -157,14 +448,29 @@ static int posix_init_event_pipe(struct posix_state* self)
 	dont_block(fds[0]);
 	dont_block(fds[1]);
 
-	self->event_pipe_rfd = fds[0];
-	self->event_pipe_wfd = fds[1];
+	*rfd = fds[0];
+	*wfd = fds[1];
 
 	return 0;
 }
 
+static void posix__drain_pipe(int fd)
+{
+	char dummy[256];
+	while (read(fd, dummy, sizeof(dummy)) == sizeof(dummy));
+}
+
+static void posix__init_signal_pipe(void)
+{
+	posix__init_pipe(&signal_pipe_rfd, &signal_pipe_wfd);
+}
+
 static void* posix_new_state(struct aml* aml)
 {
+	pthread_once(&signal_pipe_once, posix__init_signal_pipe);
+	if (signal_pipe_rfd < 0)
+		return NULL;
+
 	struct posix_state* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
@@ -173,35 +479,37 @@ static void* posix_new_state(struct aml* aml)
 	self->max_fds = 128;
 	self->fds = malloc(sizeof(*self->fds) * self->max_fds);
 	self->handlers = malloc(sizeof(*self->handlers) * self->max_fds);
-	if (!self->fds || !self->handlers) {
-		free(self->fds);
-		free(self->handlers);
+	self->op_slots = calloc(self->max_fds, sizeof(*self->op_slots));
+	if (!self->fds || !self->handlers || !self->op_slots)
 		goto failure;
-	}
 
-	TAILQ_INIT(&self->fd_ops);
 	pthread_mutex_init(&self->fd_ops_mutex, NULL);
+	pthread_mutex_init(&self->poll_mutex, NULL);
 
-	pthread_mutex_init(&self->wait_mutex, NULL);
-	pthread_cond_init(&self->wait_cond, NULL);
+	if (posix__init_pipe(&self->wake_pipe_rfd, &self->wake_pipe_wfd) < 0)
+		goto pipe_failure;
 
-	pthread_mutex_init(&self->dispatch_mutex, NULL);
-	pthread_cond_init(&self->dispatch_cond, NULL);
+	self->fds[0].fd = self->wake_pipe_rfd;
+	self->fds[0].events = POLLIN;
+	self->fds[0].revents = 0;
+	self->handlers[0] = NULL;
 
-	if (posix_init_event_pipe(self) < 0)
-		goto pipe_failure;
+	self->fds[1].fd = signal_pipe_rfd;
+	self->fds[1].events = POLLIN;
+	self->fds[1].revents = 0;
+	self->handlers[1] = NULL;
 
-	if (posix_spawn_poller(self) < 0)
-		goto thread_failure;
+	self->num_fds = POSIX_RESERVED_FDS;
 
 	return self;
 
-thread_failure:
-	close(self->event_pipe_rfd);
-	close(self->event_pipe_wfd);
 pipe_failure:
+	pthread_mutex_destroy(&self->poll_mutex);
 	pthread_mutex_destroy(&self->fd_ops_mutex);
 failure:
+	free(self->op_slots);
+	free(self->fds);
+	free(self->handlers);
 	free(self);
 	return NULL;
 }
@@ -209,28 +517,23 @@ failure:
 static int posix__find_handler(struct posix_state* self,
                                struct aml_handler* handler)
 {
-	for (uint32_t i = 0; i < self->num_fds; ++i)
-		if (self->handlers[i] == handler)
-			return i;
-
-	return -1;
+	uint32_t index = posix__handler_index(self, handler);
+	return index > 0 ? (int)index : -1;
 }
 
-static void posix_del_state(void* state)
+static void posix__stop_poller(struct posix_state* self)
 {
-	struct posix_state* self = state;
+	atomic_store(&self->poller_quit, true);
+	posix__wake(self);
 
-	posix_post_dispatch(self);
+	/* The poller may be waiting for a dispatch that won't happen */
+	pthread_mutex_lock(&self->dispatch_mutex);
+	self->waiting_for_dispatch = false;
+	pthread_cond_signal(&self->dispatch_cond);
+	pthread_mutex_unlock(&self->dispatch_mutex);
 
-	pthread_cancel(self->poller_thread);
 	pthread_join(self->poller_thread, NULL);
 
-	struct posix_fd_op* op;
-	while ((op = posix__dequeue_fd_op(self))) {
-		aml_unref(op->handler);
-		free(op);
-	}
-
 	close(self->event_pipe_rfd);
 	close(self->event_pipe_wfd);
 
@@ -238,29 +541,85 @@ static void posix_del_state(void* state)
 	pthread_mutex_destroy(&self->dispatch_mutex);
 	pthread_cond_destroy(&self->wait_cond);
 	pthread_mutex_destroy(&self->wait_mutex);
+}
+
+static void posix_del_state(void* state)
+{
+	struct posix_state* self = state;
+
+	if (atomic_load(&self->have_poller))
+		posix__stop_poller(self);
+
+	/* Handlers may outlive the main loop and be started elsewhere, so
+	 * they must not be left with tags that point into this one.
+	 */
+	for (uint32_t i = POSIX_RESERVED_FDS; i < self->num_fds; ++i)
+		if (posix__get_tag(self->handlers[i]) == (intptr_t)i)
+			posix__set_tag(self->handlers[i], 0);
+
+	for (uint32_t i = 0; i < self->pending_ops.len; ++i) {
+		struct aml_handler* handler = self->pending_ops.ops[i].handler;
+		if (posix__get_tag(handler) == -(intptr_t)i - 1)
+			posix__set_tag(handler, 0);
+		aml_unref(handler);
+	}
+
+	close(self->wake_pipe_rfd);
+	close(self->wake_pipe_wfd);
+
+	pthread_mutex_destroy(&self->poll_mutex);
 	pthread_mutex_destroy(&self->fd_ops_mutex);
+	free(self->applying_ops.ops);
+	free(self->pending_ops.ops);
+	posix__free_spare_fds(self);
+	free(self->op_slots);
 	free(self->handlers);
 	free(self->fds);
 	free(self);
 }
 
-static int posix_get_fd(const void* state)
-{
-	const struct posix_state* self = state;
-	return self->event_pipe_rfd;
-}
+static void posix_add_fd_op(struct posix_state* self,
+		struct aml_handler* handler);
+static void posix_mod_fd_op(struct posix_state* self,
+		struct aml_handler* handler);
+static void posix_del_fd_op(struct posix_state* self,
+		struct aml_handler* handler);
 
 static void posix__apply_fd_ops(struct posix_state* self)
 {
-	while (1) {
-		struct posix_fd_op* op = posix__dequeue_fd_op(self);
-		if (!op)
-			break;
+	pthread_mutex_lock(&self->fd_ops_mutex);
+
+	struct posix_fd_op_list batch = self->pending_ops;
+	self->pending_ops = self->applying_ops;
+	self->applying_ops = batch;
 
-		op->call(self, op->handler);
-		aml_unref(op->handler);
-		free(op);
+	for (uint32_t i = 0; i < batch.len; ++i) {
+		struct posix_fd_op* op = &batch.ops[i];
+
+		switch (op->type) {
+		case POSIX_FD_OP_ADD:
+			posix_add_fd_op(self, op->handler);
+			break;
+		case POSIX_FD_OP_MOD:
+			posix_mod_fd_op(self, op->handler);
+			break;
+		case POSIX_FD_OP_DEL:
+			posix_del_fd_op(self, op->handler);
+			break;
+		case POSIX_FD_OP_NONE:
+			break;
+		}
 	}
+
+	pthread_mutex_unlock(&self->fd_ops_mutex);
+
+	/* Dropping the last reference may call back into the loop, so this
+	 * must happen outside of the lock.
+	 */
+	for (uint32_t i = 0; i < batch.len; ++i)
+		aml_unref(batch.ops[i].handler);
+
+	self->applying_ops.len = 0;
 }
 
 static enum aml_event posix_poll_events_to_aml_events(uint32_t poll_events)
@@ -270,18 +629,89 @@ static enum aml_event posix_poll_events_to_aml_events(uint32_t poll_events)
 	if (poll_events & (POLLIN | POLLPRI))
 		aml_events |= AML_EVENT_READ;
 	if (poll_events & POLLOUT)
-		aml_events |= AML_EVENT_READ;
+		aml_events |= AML_EVENT_WRITE;
 
 	return aml_events;
 }
 
-static int posix_do_poll(struct posix_state* self, int timeout)
+static uint64_t posix__gettime_us(void)
 {
-	int nfds = poll(self->fds, self->num_fds, timeout);
-	if (nfds <= 0)
-		return nfds;
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
+}
+
+/* Get the poll() timeout until the next deadline in ms */
+static int posix__get_timeout(struct posix_state* self, int timeout)
+{
+	uint64_t deadline = atomic_load(&self->deadline);
+	if (deadline == 0)
+		return timeout;
+
+	uint64_t now = posix__gettime_us();
+	if (deadline <= now)
+		return 0;
+
+	/* Round up so that we don't wake up before the deadline */
+	uint64_t until_deadline = (deadline - now + 999) / 1000;
+	if (until_deadline > INT32_MAX)
+		until_deadline = INT32_MAX;
+
+	if (timeout >= 0 && (uint64_t)timeout < until_deadline)
+		return timeout;
+
+	return until_deadline;
+}
+
+/* Clear the deadline if it has passed. The backend's timer is one-shot, like
+ * the timerfd in the epoll backend.
+ */
+static bool posix__deadline_expired(struct posix_state* self)
+{
+	uint64_t deadline = atomic_load(&self->deadline);
+	if (deadline == 0 || deadline > posix__gettime_us())
+		return false;
+
+	atomic_compare_exchange_strong(&self->deadline, &deadline, 0);
+	return true;
+}
+
+/* Returns the number of ready fds, not counting the reserved ones */
+static int posix__do_poll(struct posix_state* self, int timeout)
+{
+	/* This must be set before the fd operations are applied and the
+	 * deadline is read. See posix__wake_if_polling().
+	 */
+	atomic_store(&self->polling, true);
+
+	posix__apply_fd_ops(self);
+
+	int nfds = poll(self->fds, self->num_fds,
+			posix__get_timeout(self, timeout));
+
+	atomic_store(&self->polling, false);
+
+	if (nfds > 0 && self->fds[0].revents) {
+		posix__drain_pipe(self->wake_pipe_rfd);
+		atomic_store(&self->wake_pending, false);
+		self->fds[0].revents = 0;
+		nfds--;
+	}
+
+	if (nfds > 0 && self->fds[1].revents) {
+		posix__drain_pipe(signal_pipe_rfd);
+		self->fds[1].revents = 0;
+		nfds--;
+
+		posix__dispatch_signals(self);
+	}
+
+	return nfds;
+}
 
-	for (uint32_t i = 0; i < self->num_fds; ++i)
+static void posix__emit_events(struct posix_state* self)
+{
+	for (uint32_t i = POSIX_RESERVED_FDS; i < self->num_fds; ++i)
 		if (self->fds[i].revents) {
 			struct pollfd* pfd = &self->fds[i];
 			struct aml_handler* handler = self->handlers[i];
@@ -290,9 +720,8 @@ static int posix_do_poll(struct posix_state* self, int timeout)
 			enum aml_event events =
 				posix_poll_events_to_aml_events(pfd->revents);
 			aml_emit(self->aml, handler, events);
+			pfd->revents = 0;
 		}
-
-	return nfds;
 }
 
 static void posix_wake_up_main(struct posix_state* self, int nfds)
@@ -312,92 +741,156 @@ static void posix_wake_up_main(struct posix_state* self, int nfds)
 	pthread_mutex_unlock(&self->dispatch_mutex);
 }
 
-static void dummy_handler()
-{
-}
-
 static void* posix_poll_thread(void* state)
 {
 	struct posix_state* self = state;
 
-	while (1) {
-		posix__apply_fd_ops(self);
+	while (!atomic_load(&self->poller_quit)) {
+		pthread_mutex_lock(&self->poll_mutex);
+		int nfds = posix__do_poll(self, -1);
+		pthread_mutex_unlock(&self->poll_mutex);
 
-		int nfds = posix_do_poll(self, -1);
-		if (nfds > 0) {
-			char one = 1;
-			write(self->event_pipe_wfd, &one, sizeof(one));
-		}
+		if (nfds == 0 && !posix__deadline_expired(self) &&
+				!atomic_exchange(&self->interrupted, false))
+			continue;
 
-		if (nfds != 0)
-			posix_wake_up_main(self, nfds);
+		char one = 1;
+		write(self->event_pipe_wfd, &one, sizeof(one));
+
+		/* The main thread emits the events while this thread waits
+		 * for them to be dispatched.
+		 */
+		posix_wake_up_main(self, nfds != 0 ? nfds : -1);
 	}
 
 	return NULL;
 }
 
-static int posix_spawn_poller(struct posix_state* self)
+static int posix__spawn_poller(struct posix_state* self)
 {
-	struct sigaction sa = { .sa_handler = dummy_handler };
-	struct sigaction sa_old;
-	sigaction(SIGUSR1, &sa, &sa_old);
+	if (posix__init_pipe(&self->event_pipe_rfd, &self->event_pipe_wfd) < 0)
+		return -1;
 
-	return pthread_create(&self->poller_thread, NULL, posix_poll_thread,
-	                      self);
+	pthread_mutex_init(&self->wait_mutex, NULL);
+	pthread_cond_init(&self->wait_cond, NULL);
+
+	pthread_mutex_init(&self->dispatch_mutex, NULL);
+	pthread_cond_init(&self->dispatch_cond, NULL);
 
-	sigaction(SIGUSR1, &sa_old, NULL);
+	if (pthread_create(&self->poller_thread, NULL, posix_poll_thread,
+				self) != 0)
+		goto failure;
+
+	atomic_store(&self->have_poller, true);
+
+	/* The main loop may be blocking in poll() right now. It must let go
+	 * so that the poller can take over.
+	 */
+	posix__wake(self);
+	return 0;
+
+failure:
+	pthread_cond_destroy(&self->dispatch_cond);
+	pthread_mutex_destroy(&self->dispatch_mutex);
+	pthread_cond_destroy(&self->wait_cond);
+	pthread_mutex_destroy(&self->wait_mutex);
+	close(self->event_pipe_rfd);
+	close(self->event_pipe_wfd);
+	return -1;
 }
 
-static int posix_poll(void* state, int timeout)
+static int posix_get_fd(const void* state)
+{
+	/* Nesting requires an fd that becomes readable when any of the
+	 * loop's fds do, which poll() can't provide, so a thread is spawned to
+	 * do the polling from here on.
+	 */
+	struct posix_state* self = (struct posix_state*)state;
+	int rc = 0;
+
+	pthread_mutex_lock(&self->fd_ops_mutex);
+	if (!atomic_load(&self->have_poller))
+		rc = posix__spawn_poller(self);
+	pthread_mutex_unlock(&self->fd_ops_mutex);
+
+	return rc < 0 ? -1 : self->event_pipe_rfd;
+}
+
+static int posix__wait_for_poller(struct posix_state* self, int timeout)
 {
-	struct posix_state* self = state;
 	int nfds;
 
-	if (timeout == 0) {
-		pthread_mutex_lock(&self->wait_mutex);
-		nfds = self->nfds;
-		self->nfds = 0;
-		pthread_mutex_unlock(&self->wait_mutex);
-	} else if (timeout < 0) {
-		pthread_mutex_lock(&self->wait_mutex);
+	pthread_mutex_lock(&self->wait_mutex);
+
+	if (timeout < 0) {
 		while (self->nfds == 0)
 			pthread_cond_wait(&self->wait_cond, &self->wait_mutex);
-		nfds = self->nfds;
-		self->nfds = 0;
-		pthread_mutex_unlock(&self->wait_mutex);
-	} else {
+	} else if (timeout > 0) {
 		struct timespec ts = { 0 };
 		clock_gettime(CLOCK_REALTIME, &ts);
 		uint32_t ms = timeout + ts.tv_nsec / 1000000UL;
 		ts.tv_sec += ms / 1000UL;
 		ts.tv_nsec = (ms % 1000UL) * 1000000UL;
 
-		pthread_mutex_lock(&self->wait_mutex);
 		while (self->nfds == 0) {
 			int rc = pthread_cond_timedwait(&self->wait_cond,
 			                                &self->wait_mutex, &ts);
 			if (rc == ETIMEDOUT)
 				break;
 		}
-		nfds = self->nfds;
-		self->nfds = 0;
-		pthread_mutex_unlock(&self->wait_mutex);
 	}
 
-	if (nfds > 0) {
-		char dummy[256];
-		while (read(self->event_pipe_rfd, dummy, sizeof(dummy)) == sizeof(dummy));
-	} else if (nfds < 0) {
+	nfds = self->nfds;
+	self->nfds = 0;
+	pthread_mutex_unlock(&self->wait_mutex);
+
+	if (nfds != 0) {
+		self->poller_waiting = true;
+		posix__drain_pipe(self->event_pipe_rfd);
+
+		/* The poller is waiting for dispatch, so the fd array can't
+		 * change under our feet.
+		 */
+		posix__emit_events(self);
+	}
+
+	if (nfds < 0)
 		errno = EINTR;
+
+	return nfds;
+}
+
+static int posix_poll(void* state, int timeout)
+{
+	struct posix_state* self = state;
+
+	if (atomic_load(&self->have_poller))
+		return posix__wait_for_poller(self, timeout);
+
+	pthread_mutex_lock(&self->poll_mutex);
+
+	/* A poller may have been spawned while waiting for the lock */
+	if (atomic_load(&self->have_poller)) {
+		pthread_mutex_unlock(&self->poll_mutex);
+		return posix__wait_for_poller(self, timeout);
 	}
 
+	int nfds = posix__do_poll(self, timeout);
+	if (nfds > 0)
+		posix__emit_events(self);
+
+	pthread_mutex_unlock(&self->poll_mutex);
+
+	posix__deadline_expired(self);
+	atomic_store(&self->interrupted, false);
+
 	return nfds;
 }
 
 static uint32_t posix_get_event_mask(struct aml_handler* handler)
 {
 	uint32_t poll_events  = 0;
-	enum aml_event aml_events = aml_get_event_mask(handler);
+	enum aml_event aml_events = aml_get_active_event_mask(handler);
 
 	if (aml_events & AML_EVENT_READ)
 		poll_events |= POLLIN | POLLPRI;
@@ -407,18 +900,33 @@ static uint32_t posix_get_event_mask(struct aml_handler* handler)
 	return poll_events;
 }
 
+/* The following are called with fd_ops_mutex held */
 static void posix_add_fd_op(struct posix_state* self, struct aml_handler* handler)
 {
 	if (self->num_fds >= self->max_fds) {
-		uint32_t new_max = self->max_fds * 2;
-		struct pollfd* fds = realloc(self->fds, sizeof(*fds) * new_max);
-		struct aml_handler** hds =
-			realloc(self->handlers, sizeof(*hds) * new_max);
-		assert(fds && hds);
-
-		self->fds = fds;
-		self->handlers = hds;
-		self->max_fds = new_max;
+		/* Room was reserved when the op was queued */
+		assert(self->spare_max_fds > self->num_fds);
+
+		uint32_t n = self->num_fds;
+		memcpy(self->spare_fds, self->fds, sizeof(*self->fds) * n);
+		memcpy(self->spare_handlers, self->handlers,
+				sizeof(*self->handlers) * n);
+		memcpy(self->spare_op_slots, self->op_slots,
+				sizeof(*self->op_slots) * n);
+
+		free(self->fds);
+		free(self->handlers);
+		free(self->op_slots);
+
+		self->fds = self->spare_fds;
+		self->handlers = self->spare_handlers;
+		self->op_slots = self->spare_op_slots;
+		self->max_fds = self->spare_max_fds;
+
+		self->spare_fds = NULL;
+		self->spare_handlers = NULL;
+		self->spare_op_slots = NULL;
+		self->spare_max_fds = 0;
 	}
 
 	struct pollfd* event = &self->fds[self->num_fds];
@@ -427,6 +935,8 @@ static void posix_add_fd_op(struct posix_state* self, struct aml_handler* handle
 	event->fd = aml_get_fd(handler);
 
 	self->handlers[self->num_fds] = handler;
+	self->op_slots[self->num_fds] = 0;
+	posix__set_tag(handler, self->num_fds);
 
 	self->num_fds++;
 }
@@ -437,6 +947,7 @@ static void posix_mod_fd_op(struct posix_state* self, struct aml_handler* handle
 	if (index < 0)
 		return;
 
+	self->op_slots[index] = 0;
 	self->fds[index].fd = aml_get_fd(handler);
 	self->fds[index].events = posix_get_event_mask(handler);
 }
@@ -447,31 +958,78 @@ static void posix_del_fd_op(struct posix_state* self, struct aml_handler* handle
 	if (index < 0)
 		return;
 
+	self->op_slots[index] = 0;
 	self->num_fds--;
 
+	/* The last handler may still have an op later in the batch, so its
+	 * slot moves along with it.
+	 */
 	self->fds[index] = self->fds[self->num_fds];
 	self->handlers[index] = self->handlers[self->num_fds];
+	self->op_slots[index] = self->op_slots[self->num_fds];
+	posix__set_tag(self->handlers[index], index);
+	posix__set_tag(handler, 0);
 }
 
 static int posix_add_fd(void* state, struct aml_handler* handler)
 {
-	return posix__enqueue_fd_op(state, posix_add_fd_op, handler);
+	return posix__enqueue_fd_op(state, POSIX_FD_OP_ADD, handler);
+}
+
+static int posix_add_fds(void* state, struct aml_handler* const* handlers,
+		int n)
+{
+	struct posix_state* self = state;
+	struct posix_fd_op_list* list = &self->pending_ops;
+
+	pthread_mutex_lock(&self->fd_ops_mutex);
+
+	/* With room for an op and an fd per handler, queueing cannot fail
+	 * halfway through.
+	 */
+	while (list->cap < list->len + n)
+		if (posix__grow_fd_op_list(list) < 0)
+			goto failure;
+
+	if (posix__reserve_fds(self, self->num_fds + list->len + n) < 0)
+		goto failure;
+
+	for (int i = 0; i < n; ++i) {
+		int rc = posix__enqueue_fd_op_locked(self, POSIX_FD_OP_ADD,
+				handlers[i]);
+		assert(rc == 0);
+		(void)rc;
+	}
+
+	pthread_mutex_unlock(&self->fd_ops_mutex);
+
+	posix__wake_if_polling(self);
+	return 0;
+
+failure:
+	pthread_mutex_unlock(&self->fd_ops_mutex);
+	return -1;
 }
 
 static int posix_mod_fd(void* state, struct aml_handler* handler)
 {
-	return posix__enqueue_fd_op(state, posix_mod_fd_op, handler);
+	return posix__enqueue_fd_op(state, POSIX_FD_OP_MOD, handler);
 }
 
 static int posix_del_fd(void* state, struct aml_handler* handler)
 {
-	return posix__enqueue_fd_op(state, posix_del_fd_op, handler);
+	return posix__enqueue_fd_op(state, POSIX_FD_OP_DEL, handler);
 }
 
 static int posix_add_signal(void* state, struct aml_signal* sig)
 {
 	int signo = aml_get_signo(sig);
 
+	if (signo <= 0 || signo >= POSIX_MAX_SIGNO) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	struct signal_handler* handler = calloc(1, sizeof(*handler));
 	if (!handler)
 		return -1;
@@ -479,34 +1037,39 @@ static int posix_add_signal(void* state, struct aml_signal* sig)
 	handler->state = state;
 	handler->sig = sig;
 
-	if (!signal_handler_find_by_signo(signo)) {
-		sigset_t set;
-		sigemptyset(&set);
-		sigaddset(&set, signo);
-		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_mutex_lock(&signal_mutex);
 
+	if (!signal_handler_find_by_signo(signo)) {
 		struct sigaction sa = {
 			.sa_handler = posix__signal_handler,
 		};
 
+		atomic_store(&signal_pending[signo], 0);
+
 		if (sigaction(aml_get_signo(sig), &sa, NULL) < 0)
 			goto failure;
 	}
 
 	LIST_INSERT_HEAD(&signal_handlers, handler, link);
 
+	pthread_mutex_unlock(&signal_mutex);
 	return 0;
 
 failure:
+	pthread_mutex_unlock(&signal_mutex);
 	free(handler);
 	return -1;
 }
 
 static int posix_del_signal(void* state, struct aml_signal* sig)
 {
+	pthread_mutex_lock(&signal_mutex);
+
 	struct signal_handler* handler = signal_handler_find_by_obj(sig);
-	if (!handler)
+	if (!handler) {
+		pthread_mutex_unlock(&signal_mutex);
 		return -1;
+	}
 
 	LIST_REMOVE(handler, link);
 
@@ -518,13 +1081,10 @@ static int posix_del_signal(void* state, struct aml_signal* sig)
 		int signo = aml_get_signo(sig);
 
 		sigaction(signo, &sa, NULL);
-
-		sigset_t set;
-		sigemptyset(&set);
-		sigaddset(&set, signo);
-		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 	}
 
+	pthread_mutex_unlock(&signal_mutex);
+
 	free(handler);
 	return 0;
 }
@@ -533,6 +1093,14 @@ static void posix_post_dispatch(void* state)
 {
 	struct posix_state* self = state;
 
+	/* Only a dispatch of events that came from the poller may release
+	 * it.
+	 */
+	if (!self->poller_waiting)
+		return;
+
+	self->poller_waiting = false;
+
 	pthread_mutex_lock(&self->dispatch_mutex);
 	self->waiting_for_dispatch = false;
 	pthread_cond_signal(&self->dispatch_cond);
@@ -542,20 +1110,34 @@ static void posix_post_dispatch(void* state)
 static void posix_interrupt(void* state)
 {
 	struct posix_state* self = state;
-	pthread_kill(self->poller_thread, SIGUSR1);
+	atomic_store(&self->interrupted, true);
+	posix__wake(self);
+}
+
+static int posix_set_deadline(void* state, uint64_t deadline)
+{
+	struct posix_state* self = state;
+
+	atomic_store(&self->deadline, deadline);
+	posix__wake_if_polling(self);
+
+	return 0;
 }
 
 const struct aml_backend posix_backend = {
 	.new_state = posix_new_state,
 	.del_state = posix_del_state,
+	.clock = CLOCK_MONOTONIC,
 	.get_fd = posix_get_fd,
 	.poll = posix_poll,
 	.exit = NULL,
 	.add_fd = posix_add_fd,
+	.add_fds = posix_add_fds,
 	.mod_fd = posix_mod_fd,
 	.del_fd = posix_del_fd,
 	.add_signal = posix_add_signal,
 	.del_signal = posix_del_signal,
+	.set_deadline = posix_set_deadline,
 	.post_dispatch = posix_post_dispatch,
 	.interrupt = posix_interrupt,
 };
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "aml.h"
+#include "backend.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define AML_STREAM_MAX_IOV 64
+
+struct aml_stream {
+	struct aml* aml;
+	struct aml_handler* handler;
+
+	aml_stream_fn cb;
+	void* userdata;
+
+	/* Slices that could not be written right away, as a ring buffer */
+	struct aml_slice* queue;
+	size_t queue_head;
+	size_t queue_len;
+	size_t queue_cap;
+	size_t queued_bytes;
+
+	int error;
+};
+
+static void aml_stream__on_event(void* obj);
+
+EXPORT
+struct aml_stream* aml_stream_new(struct aml* aml, int fd, aml_stream_fn cb,
+		void* userdata)
+{
+	struct aml_stream* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->aml = aml;
+	self->cb = cb;
+	self->userdata = userdata;
+
+	self->handler = aml_handler_new(fd, aml_stream__on_event, self, NULL);
+	if (!self->handler)
+		goto failure;
+
+	return self;
+
+failure:
+	free(self);
+	return NULL;
+}
+
+static struct aml_slice* aml_stream__queue_at(struct aml_stream* self,
+		size_t i)
+{
+	return &self->queue[(self->queue_head + i) % self->queue_cap];
+}
+
+static void aml_stream__clear_queue(struct aml_stream* self)
+{
+	for (size_t i = 0; i < self->queue_len; ++i)
+		aml_slice_release(aml_stream__queue_at(self, i));
+
+	self->queue_head = 0;
+	self->queue_len = 0;
+	self->queued_bytes = 0;
+}
+
+EXPORT
+void aml_stream_del(struct aml_stream* self)
+{
+	if (!self)
+		return;
+
+	aml_stop(self->aml, self->handler);
+	aml_unref(self->handler);
+
+	aml_stream__clear_queue(self);
+	free(self->queue);
+	free(self);
+}
+
+EXPORT
+int aml_stream_start(struct aml_stream* self)
+{
+	return aml_start(self->aml, self->handler);
+}
+
+EXPORT
+void aml_stream_read_now(struct aml_stream* self)
+{
+	aml_emit(self->aml, self->handler, AML_EVENT_READ);
+}
+
+EXPORT
+int aml_stream_get_fd(const struct aml_stream* self)
+{
+	return aml_get_fd(self->handler);
+}
+
+EXPORT
+size_t aml_stream_get_queued(const struct aml_stream* self)
+{
+	return self->queued_bytes;
+}
+
+EXPORT
+int aml_stream_get_error(const struct aml_stream* self)
+{
+	return self->error;
+}
+
+static int aml_stream__push(struct aml_stream* self,
+		const struct aml_slice* slice)
+{
+	if (self->queue_len == self->queue_cap) {
+		size_t cap = self->queue_cap ? self->queue_cap * 2 : 16;
+		struct aml_slice* queue = malloc(cap * sizeof(*queue));
+		if (!queue)
+			return -1;
+
+		for (size_t i = 0; i < self->queue_len; ++i)
+			queue[i] = *aml_stream__queue_at(self, i);
+
+		free(self->queue);
+		self->queue = queue;
+		self->queue_cap = cap;
+		self->queue_head = 0;
+	}
+
+	*aml_stream__queue_at(self, self->queue_len++) = *slice;
+	self->queued_bytes += slice->len;
+	return 0;
+}
+
+static void aml_stream__update_mask(struct aml_stream* self)
+{
+	enum aml_event mask = AML_EVENT_READ;
+	if (self->queue_len > 0)
+		mask |= AML_EVENT_WRITE;
+
+	if (aml_get_event_mask(self->handler) != mask)
+		aml_set_event_mask(self->handler, mask);
+}
+
+/* Returns: 0 when the queue is empty, 1 if writing would block or -1 on
+ * error.
+ */
+static int aml_stream__flush(struct aml_stream* self)
+{
+	int fd = aml_get_fd(self->handler);
+
+	while (self->queue_len > 0) {
+		struct iovec iov[AML_STREAM_MAX_IOV];
+		int n_iov = 0;
+
+		for (size_t i = 0; i < self->queue_len &&
+				n_iov < AML_STREAM_MAX_IOV; ++i) {
+			struct aml_slice* slice = aml_stream__queue_at(self, i);
+			iov[n_iov].iov_base = (void*)aml_slice_data(slice);
+			iov[n_iov].iov_len = slice->len;
+			n_iov++;
+		}
+
+		ssize_t rc = writev(fd, iov, n_iov);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+
+			/* Nothing more can be written, so there's no point in
+			 * holding on to the rest.
+			 */
+			self->error = errno;
+			aml_stream__clear_queue(self);
+			return -1;
+		}
+
+		size_t written = rc;
+		self->queued_bytes -= written;
+
+		while (written > 0) {
+			struct aml_slice* head = aml_stream__queue_at(self, 0);
+			if (written < head->len) {
+				head->offset += written;
+				head->len -= written;
+				break;
+			}
+
+			written -= head->len;
+			aml_slice_release(head);
+			self->queue_head = (self->queue_head + 1) %
+				self->queue_cap;
+			self->queue_len--;
+		}
+	}
+
+	return 0;
+}
+
+EXPORT
+int aml_stream_write(struct aml_stream* self, const struct aml_slice* slice)
+{
+	if (self->error) {
+		errno = self->error;
+		return -1;
+	}
+
+	size_t written = 0;
+
+	/* Most of the time the socket is writable, so the data is written
+	 * right away instead of waiting for the main loop to say so.
+	 */
+	while (self->queue_len == 0 && written < slice->len) {
+		ssize_t rc = write(aml_stream_get_fd(self),
+				(const char*)aml_slice_data(slice) + written,
+				slice->len - written);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			self->error = errno;
+			return -1;
+		}
+
+		written += rc;
+	}
+
+	if (written == slice->len)
+		return 0;
+
+	struct aml_slice rest = aml_slice_new(slice->buf,
+			slice->offset + written, slice->len - written);
+	if (aml_stream__push(self, &rest) < 0) {
+		aml_slice_release(&rest);
+		return -1;
+	}
+
+	aml_stream__update_mask(self);
+	return 0;
+}
+
+static void aml_stream__on_event(void* obj)
+{
+	struct aml_stream* self = aml_get_userdata(obj);
+	enum aml_event revents = aml_get_revents(obj);
+	enum aml_stream_event events = 0;
+
+	if ((revents & AML_EVENT_WRITE) && self->queue_len > 0) {
+		int rc = aml_stream__flush(self);
+		if (rc < 0)
+			events |= AML_STREAM_ERROR;
+		else if (rc == 0)
+			events |= AML_STREAM_DRAINED;
+
+		aml_stream__update_mask(self);
+	}
+
+	if (revents & AML_EVENT_READ)
+		events |= AML_STREAM_READABLE;
+
+	/* This must be the last thing that is done, because the stream may be
+	 * deleted in the callback.
+	 */
+	if (events && self->cb)
+		self->cb(self->userdata, events);
+}